@@ -0,0 +1,480 @@
+#ifndef VE281P2_CUCKOO_HASHTABLE_HPP
+#define VE281P2_CUCKOO_HASHTABLE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/**
+ * A bucketized cuckoo hashtable, with the same interface as HashTable
+ * Every key has two candidate buckets of SLOTS slots each, so a lookup reads at most two buckets
+ * whatever the keys are. Buckets are aligned to cache lines; if at least 3 elements fit in a cache line
+ * beside the tags and the version (sizeof(Key) + sizeof(Value) <= 18, e.g. 8-byte keys and values),
+ * SLOTS is the number of elements that fit, so a bucket is one cache line and a lookup reads at most two.
+ * Larger elements use 4 slots per bucket, which then spans several cache lines.
+ * Each slot has a one-byte tag (a fingerprint of the hash value, 0 for an empty slot),
+ * so keys are only compared when the tags match.
+ * When both buckets are full, insert searches the shortest eviction path with BFS and moves
+ * the elements along the path backward, starting from the empty slot. An element is always
+ * copied to its new slot before the old slot is cleared, so it can always be found during a move.
+ * Each bucket also has a version, which is odd while the bucket is being written.
+ * The hashtable is not thread-safe by itself; the versions are kept so that lookups can later be
+ * made optimistic (read the versions of both buckets before and after, retry if they changed).
+ * The time complexity of functions are based on n and k
+ * n is the size of the hashtable
+ * k is the length of Key
+ * @tparam Key          key type, default constructible
+ * @tparam Value        data type, default constructible
+ * @tparam Hash         function object, return the hash value of a key
+ * @tparam KeyEqual     function object, return whether two keys are the same
+ */
+template<
+        typename Key, typename Value,
+        typename Hash = std::hash<Key>,
+        typename KeyEqual = std::equal_to<Key>
+>
+class CuckooHashTable {
+public:
+    typedef std::pair<Key, Value> HashNode;
+    static constexpr size_t CACHE_LINE = 64;
+    // Elements that fit in a cache line beside the tags and the version (at most 4 + 4 bytes)
+    static constexpr size_t LINE_SLOTS = (CACHE_LINE - 8) / sizeof(HashNode);
+    static constexpr size_t SLOTS = LINE_SLOTS >= 3 ? std::min<size_t>(LINE_SLOTS, 4) : 4;
+
+protected:
+    struct alignas(CACHE_LINE) Bucket {
+        uint8_t tags[SLOTS] = {};   // 0 if the slot is empty
+        uint32_t version = 0;       // odd while the bucket is being written
+        HashNode slots[SLOTS];
+    };
+    static_assert(LINE_SLOTS < 3 || sizeof(Bucket) == CACHE_LINE, "a bucket of small elements is one cache line");
+
+    // A step of the eviction path found by BFS
+    struct PathEntry {
+        size_t bucket;
+        size_t slot;
+        size_t parent;              // index of the previous step in the BFS queue, NO_PARENT for the start
+    };
+
+    // bucketized cuckoo hashing works up to ~0.98 with 4 slots and ~0.91 with 3
+    static constexpr double DEFAULT_LOAD_FACTOR = SLOTS == 4 ? 0.9 : 0.85;
+    static constexpr size_t DEFAULT_BUCKET_SIZE = 4;    // number of buckets, always a power of 2
+    static constexpr size_t MAX_BFS_ENTRIES = 512;      // give up the eviction search and grow after this
+    static constexpr size_t NO_PARENT = ~size_t(0);
+
+    std::vector<Bucket> buckets;
+    size_t bucketMask;          // buckets.size() - 1
+    size_t tableSize = 0;
+    double maxLoadFactor = DEFAULT_LOAD_FACTOR;
+    Hash hash;
+    KeyEqual keyEqual;
+
+    // The two candidate buckets and the tag of a key
+    struct Position {
+        size_t first;
+        size_t second;
+        uint8_t tag;
+    };
+
+    /**
+     * Mix the bits of a hash value (the finalizer of MurmurHash3),
+     * since std::hash of an integer is usually the identity
+     */
+    static inline uint64_t mix(uint64_t value) {
+        value ^= value >> 33;
+        value *= 0xff51afd7ed558ccdULL;
+        value ^= value >> 33;
+        value *= 0xc4ceb9fe1a85ec53ULL;
+        value ^= value >> 33;
+        return value;
+    }
+
+    /**
+     * Time Complexity: O(k)
+     * @param key
+     * @return the two candidate buckets and the tag of key, Hash is only called once
+     */
+    Position locate(const Key &key) const {
+        uint64_t value = mix((uint64_t) hash(key));
+        Position position{};
+        position.first = (size_t) value & bucketMask;
+        position.second = (size_t) mix(value ^ 0x9e3779b97f4a7c15ULL) & bucketMask;
+        position.tag = (uint8_t) (value >> 56);
+        if (position.tag == 0) position.tag = 1;
+        return position;
+    }
+
+    /**
+     * Time Complexity: O(k)
+     * @param bucket
+     * @param key
+     * @param tag
+     * @return the slot of key in bucket, or SLOTS if it is not there
+     */
+    size_t findSlot(size_t bucket, const Key &key, uint8_t tag) const {
+        const Bucket &b = buckets[bucket];
+        for (size_t slot = 0; slot < SLOTS; slot++) {
+            if (b.tags[slot] == tag && keyEqual(b.slots[slot].first, key)) return slot;
+        }
+        return SLOTS;
+    }
+
+    /**
+     * @param bucket
+     * @return an empty slot in bucket, or SLOTS if it is full
+     */
+    size_t emptySlot(size_t bucket) const {
+        for (size_t slot = 0; slot < SLOTS; slot++) {
+            if (buckets[bucket].tags[slot] == 0) return slot;
+        }
+        return SLOTS;
+    }
+
+    /**
+     * @param bucket the current bucket of the element
+     * @param slot
+     * @return the other candidate bucket of the element
+     */
+    size_t alternative(size_t bucket, size_t slot) const {
+        Position position = locate(buckets[bucket].slots[slot].first);
+        return position.first == bucket ? position.second : position.first;
+    }
+
+    /**
+     * Write an element into an empty slot
+     * Time Complexity: O(1)
+     */
+    void place(size_t bucket, size_t slot, HashNode node, uint8_t tag) {
+        Bucket &b = buckets[bucket];
+        b.version++;
+        b.slots[slot] = std::move(node);
+        b.tags[slot] = tag;
+        b.version++;
+    }
+
+    /**
+     * Clear a slot
+     * Time Complexity: O(1)
+     */
+    void clear(size_t bucket, size_t slot) {
+        Bucket &b = buckets[bucket];
+        b.version++;
+        b.tags[slot] = 0;
+        b.slots[slot] = HashNode();
+        b.version++;
+    }
+
+    /**
+     * @param queue the BFS queue
+     * @param entry index of a step in the queue
+     * @param bucket
+     * @return whether bucket is already on the path from the start to the step
+     */
+    static bool onPath(const std::vector<PathEntry> &queue, size_t entry, size_t bucket) {
+        for (; entry != NO_PARENT; entry = queue[entry].parent) {
+            if (queue[entry].bucket == bucket) return true;
+        }
+        return false;
+    }
+
+    /**
+     * Make an empty slot in one of the two buckets by moving elements along an eviction path
+     * Time Complexity: O(k * MAX_BFS_ENTRIES) in the worst case
+     * @param position
+     * @return (bucket, slot) of the empty slot, or (SLOTS, SLOTS) if no path is found
+     */
+    std::pair<size_t, size_t> makeRoom(const Position &position) {
+        std::vector<PathEntry> queue;
+        for (size_t slot = 0; slot < SLOTS; slot++) queue.push_back({position.first, slot, NO_PARENT});
+        if (position.second != position.first) {
+            for (size_t slot = 0; slot < SLOTS; slot++) queue.push_back({position.second, slot, NO_PARENT});
+        }
+        for (size_t head = 0; head < queue.size() && queue.size() < MAX_BFS_ENTRIES; head++) {
+            PathEntry entry = queue[head];
+            size_t target = alternative(entry.bucket, entry.slot);
+            size_t targetSlot = emptySlot(target);
+            if (targetSlot == SLOTS) {
+                // The alternative bucket is full too, try to move each of its elements,
+                // unless the path would go through the same bucket twice
+                if (onPath(queue, head, target)) continue;
+                for (size_t slot = 0; slot < SLOTS; slot++) queue.push_back({target, slot, head});
+                continue;
+            }
+            // Move the elements backward along the path, from the empty slot to the start
+            size_t current = head;
+            while (true) {
+                PathEntry &step = queue[current];
+                Bucket &from = buckets[step.bucket];
+                place(target, targetSlot, from.slots[step.slot], from.tags[step.slot]);
+                clear(step.bucket, step.slot);
+                if (step.parent == NO_PARENT) return {step.bucket, step.slot};
+                target = step.bucket;
+                targetSlot = step.slot;
+                current = step.parent;
+            }
+        }
+        return {SLOTS, SLOTS};
+    }
+
+    /**
+     * Insert an element whose key doesn't exist, growing the table until there is room
+     * Time Complexity: Amortized O(k)
+     */
+    void insertNew(HashNode node) {
+        while (true) {
+            Position position = locate(node.first);
+            size_t slot = emptySlot(position.first);
+            if (slot != SLOTS) return place(position.first, slot, std::move(node), position.tag);
+            slot = emptySlot(position.second);
+            if (slot != SLOTS) return place(position.second, slot, std::move(node), position.tag);
+            auto room = makeRoom(position);
+            if (room.first != SLOTS) return place(room.first, room.second, std::move(node), position.tag);
+            resize(buckets.size() * 2);
+        }
+    }
+
+    /**
+     * Move all elements into a table of bucketSize buckets
+     * Time Complexity: O(nk)
+     * @param bucketSize a power of 2
+     */
+    void resize(size_t bucketSize) {
+        std::vector<Bucket> oldBuckets(bucketSize);
+        oldBuckets.swap(buckets);
+        bucketMask = bucketSize - 1;
+        for (auto &bucket : oldBuckets) {
+            for (size_t slot = 0; slot < SLOTS; slot++) {
+                if (bucket.tags[slot]) insertNew(std::move(bucket.slots[slot]));
+            }
+        }
+    }
+
+    /**
+     * @param count number of elements
+     * @return the minimum power of 2 number of buckets that holds count elements under the maximum load factor
+     */
+    size_t minimumBucketSize(size_t count) const {
+        size_t bucketSize = DEFAULT_BUCKET_SIZE;
+        while ((double) count > maxLoadFactor * (double) (bucketSize * SLOTS)) bucketSize *= 2;
+        return bucketSize;
+    }
+
+public:
+    /**
+     * A single directional iterator for the hashtable
+     */
+    class Iterator {
+    private:
+        CuckooHashTable *table;
+        size_t index;   // bucket * SLOTS + slot
+
+        Iterator(CuckooHashTable *table, size_t index) : table(table), index(index) {}
+
+        void skipEmpty() {
+            size_t end = table->buckets.size() * SLOTS;
+            while (index < end && table->buckets[index / SLOTS].tags[index % SLOTS] == 0) index++;
+        }
+
+    public:
+        friend class CuckooHashTable;
+
+        Iterator() = delete;
+
+        Iterator &operator++() {
+            index++;
+            skipEmpty();
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator temp = *this;
+            ++*this;
+            return temp;
+        }
+
+        bool operator==(const Iterator &that) const { return index == that.index; }
+
+        bool operator!=(const Iterator &that) const { return index != that.index; }
+
+        // The key must not be modified
+        HashNode *operator->() const { return &table->buckets[index / SLOTS].slots[index % SLOTS]; }
+
+        HashNode &operator*() const { return table->buckets[index / SLOTS].slots[index % SLOTS]; }
+    };
+
+    // Constructor
+    CuckooHashTable() : buckets(DEFAULT_BUCKET_SIZE), bucketMask(DEFAULT_BUCKET_SIZE - 1) {}
+
+    /**
+     * @param bucketSize lower bound of the number of buckets, rounded up to a power of 2
+     */
+    explicit CuckooHashTable(size_t bucketSize) {
+        size_t size = DEFAULT_BUCKET_SIZE;
+        while (size < bucketSize) size *= 2;
+        buckets.resize(size);
+        bucketMask = size - 1;
+    }
+
+    Iterator begin() {
+        Iterator it(this, 0);
+        it.skipEmpty();
+        return it;
+    }
+
+    Iterator end() { return Iterator(this, buckets.size() * SLOTS); }
+
+    /**
+     * Find whether the key exists in the hashtable
+     * Time Complexity: O(k), at most two buckets are read
+     * @param key
+     * @return whether the key exists in the hashtable
+     */
+    bool contains(const Key &key) const {
+        Position position = locate(key);
+        return findSlot(position.first, key, position.tag) != SLOTS ||
+               findSlot(position.second, key, position.tag) != SLOTS;
+    }
+
+    /**
+     * Find the value in hashtable by key
+     * Time Complexity: O(k), at most two buckets are read
+     * @param key
+     * @return iterator of the value, or end() if the key doesn't exist
+     */
+    Iterator find(const Key &key) {
+        Position position = locate(key);
+        size_t slot = findSlot(position.first, key, position.tag);
+        if (slot != SLOTS) return Iterator(this, position.first * SLOTS + slot);
+        slot = findSlot(position.second, key, position.tag);
+        if (slot != SLOTS) return Iterator(this, position.second * SLOTS + slot);
+        return end();
+    }
+
+    /**
+     * Insert value into the hashtable according to an iterator returned by find
+     * If the key already exists, overwrite its value
+     * Time Complexity: Amortized O(k)
+     * @param it an iterator returned by find
+     * @param key
+     * @param value
+     * @return whether insertion took place (return false if the key already exists)
+     */
+    bool insert(const Iterator &it, const Key &key, const Value &value) {
+        if (it != end()) {
+            it->second = value;
+            return false;
+        }
+        if ((double) (tableSize + 1) > maxLoadFactor * (double) (buckets.size() * SLOTS)) {
+            resize(buckets.size() * 2);
+        }
+        insertNew(HashNode(key, value));
+        tableSize++;
+        return true;
+    }
+
+    /**
+     * Insert <key, value> into the hashtable
+     * If the key already exists, overwrite its value
+     * Time Complexity: Amortized O(k)
+     * @param key
+     * @param value
+     * @return whether insertion took place (return false if the key already exists)
+     */
+    bool insert(const Key &key, const Value &value) {
+        return insert(find(key), key, value);
+    }
+
+    /**
+     * Erase the key if it exists in the hashtable, otherwise, do nothing
+     * Time Complexity: O(k)
+     * @param key
+     * @return whether the key exists
+     */
+    bool erase(const Key &key) {
+        Iterator it = find(key);
+        if (it == end()) return false;
+        erase(it);
+        return true;
+    }
+
+    /**
+     * Erase the key at the input iterator
+     * Time Complexity: O(1) amortized over a full iteration
+     * @param it
+     * @return the iterator after the input iterator before the erase
+     */
+    Iterator erase(Iterator it) {
+        if (it == end()) return it;
+        clear(it.index / SLOTS, it.index % SLOTS);
+        tableSize--;
+        return ++it;
+    }
+
+    /**
+     * Get the reference of value by key in the hashtable
+     * If the key doesn't exist, create it first (use default constructor of Value)
+     * Time Complexity: Amortized O(k)
+     * @param key
+     * @return reference of value
+     */
+    Value &operator[](const Key &key) {
+        Iterator it = find(key);
+        if (it == end()) {
+            // insert may move elements, so find the key again
+            insert(it, key, Value());
+            it = find(key);
+        }
+        return it->second;
+    }
+
+    /**
+     * Rehash the hashtable according to the (hinted) number of buckets
+     * The number of buckets after rehash is the minimum power of 2 not less than bucketSize
+     * that holds all elements under the maximum load factor
+     * Time Complexity: O(nk)
+     * @param bucketSize lower bound of the new number of buckets
+     */
+    void rehash(size_t bucketSize) {
+        size_t size = minimumBucketSize(tableSize);
+        while (size < bucketSize) size *= 2;
+        if (size != buckets.size()) resize(size);
+    }
+
+    /**
+     * @return the number of elements in the hashtable
+     */
+    size_t size() const { return tableSize; }
+
+    /**
+     * @return the number of buckets in the hashtable, each one has SLOTS slots
+     */
+    size_t bucketSize() const { return buckets.size(); }
+
+    /**
+     * @return the current load factor (elements per slot) of the hashtable
+     */
+    double loadFactor() const { return (double) tableSize / (double) (buckets.size() * SLOTS); }
+
+    /**
+     * @return the maximum load factor of the hashtable
+     */
+    double getMaxLoadFactor() const { return maxLoadFactor; }
+
+    /**
+     * Set the max load factor
+     * @throw std::range_error if the load factor is not in (0, 1)
+     * @param loadFactor
+     */
+    void setMaxLoadFactor(double loadFactor) {
+        if (loadFactor <= 1e-9 || loadFactor >= 1) {
+            throw std::range_error("invalid load factor!");
+        }
+        maxLoadFactor = loadFactor;
+        rehash(buckets.size());
+    }
+};
+
+#endif //VE281P2_CUCKOO_HASHTABLE_HPP
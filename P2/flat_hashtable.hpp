@@ -0,0 +1,427 @@
+#ifndef VE281P2_FLAT_HASHTABLE_HPP
+#define VE281P2_FLAT_HASHTABLE_HPP
+
+#include "hashtable.hpp"
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Whether a <Key, Value> pair can be stored by FlatHashTable
+ * Keys must be 4 or 8 byte integers (so that they can be compared with SIMD),
+ * values must be trivially copyable and at most 8 bytes
+ */
+template<typename Key, typename Value>
+struct IsCompactHashable : std::integral_constant<bool,
+        std::is_integral<Key>::value && (sizeof(Key) == 4 || sizeof(Key) == 8) &&
+        std::is_trivially_copyable<Value>::value && sizeof(Value) <= 8> {
+};
+
+/**
+ * Compare a group of consecutive keys with one key
+ * GROUP_SIZE keys are compared at once with AVX2 or SSE2 if available, otherwise one by one
+ * @tparam Key 4 or 8 byte integer
+ */
+template<typename Key>
+struct FlatKeyGroup {
+#if defined(__AVX2__)
+    static constexpr size_t GROUP_SIZE = 32 / sizeof(Key);
+
+    /**
+     * @return a mask with sizeof(Key) bits set for each key in the group that equals key
+     */
+    static uint32_t match(const Key *group, Key key) {
+        __m256i keys = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(group));
+        __m256i target = sizeof(Key) == 4 ? _mm256_set1_epi32((int) key) : _mm256_set1_epi64x((long long) key);
+        __m256i equal = sizeof(Key) == 4 ? _mm256_cmpeq_epi32(keys, target) : _mm256_cmpeq_epi64(keys, target);
+        return (uint32_t) _mm256_movemask_epi8(equal);
+    }
+#elif defined(__SSE2__)
+    static constexpr size_t GROUP_SIZE = 16 / sizeof(Key);
+
+    static uint32_t match(const Key *group, Key key) {
+        __m128i keys = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+        if (sizeof(Key) == 4) {
+            return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi32(keys, _mm_set1_epi32((int) key)));
+        }
+        // SSE2 has no 64-bit compare, so both 32-bit halves have to be equal
+        __m128i equal = _mm_cmpeq_epi32(keys, _mm_set1_epi64x((long long) key));
+        equal = _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+        return (uint32_t) _mm_movemask_epi8(equal);
+    }
+#else
+    static constexpr size_t GROUP_SIZE = 1;
+
+    static uint32_t match(const Key *group, Key key) {
+        return *group == key ? (uint32_t(1) << sizeof(Key)) - 1 : 0;
+    }
+#endif
+
+    /**
+     * @param mask a non-zero mask returned by match
+     * @return index of the first matching key in the group
+     */
+    static size_t first(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+        return (size_t) __builtin_ctz(mask) / sizeof(Key);
+#else
+        size_t bit = 0;
+        while (!(mask >> bit & 1)) bit++;
+        return bit / sizeof(Key);
+#endif
+    }
+};
+
+/**
+ * A compact hashtable for small integer keys and small trivially copyable values
+ * Keys and values are stored in two dense arrays with linear probing, and an empty slot is marked
+ * by the sentinel key EMPTY_KEY, so there is no allocation per element. The sentinel key itself can
+ * still be inserted, it is stored in an extra slot after the table.
+ * With 4-byte keys and values the memory usage is (4 + 4) / loadFactor bytes per element,
+ * i.e. 10 bytes per element at the default maximum load factor 0.8
+ * The time complexity of functions are based on n, the size of the hashtable
+ * @tparam Key          4 or 8 byte integer type
+ * @tparam Value        trivially copyable type, at most 8 bytes
+ * @tparam Hash         function object, return the hash value of a key
+ */
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class FlatHashTable {
+    static_assert(IsCompactHashable<Key, Value>::value, "FlatHashTable only stores small integer keys and values");
+
+public:
+    static constexpr Key EMPTY_KEY = std::numeric_limits<Key>::max();
+
+    /**
+     * A single directional iterator for the hashtable
+     * Dereferencing gives a pair of references to the key and the value
+     */
+    class Iterator {
+    private:
+        FlatHashTable *table;
+        size_t slot;
+
+        Iterator(FlatHashTable *table, size_t slot) : table(table), slot(slot) {}
+
+        // Skip empty slots, the extra slot of EMPTY_KEY is after all other slots
+        void skipEmpty() {
+            while (slot < table->capacity && table->keys[slot] == EMPTY_KEY) slot++;
+            if (slot == table->capacity && !table->hasEmptyKey) slot++;
+        }
+
+    public:
+        friend class FlatHashTable;
+
+        typedef std::pair<const Key &, Value &> Reference;
+
+        // Make operator-> work on the pair of references
+        struct Pointer {
+            Reference reference;
+
+            Reference *operator->() { return &reference; }
+        };
+
+        Iterator() = delete;
+
+        Iterator &operator++() {
+            slot++;
+            skipEmpty();
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator temp = *this;
+            ++*this;
+            return temp;
+        }
+
+        bool operator==(const Iterator &that) const { return slot == that.slot; }
+
+        bool operator!=(const Iterator &that) const { return slot != that.slot; }
+
+        Reference operator*() const { return Reference(table->keys[slot], table->values[slot]); }
+
+        Pointer operator->() const { return Pointer{**this}; }
+    };
+
+protected:
+    static constexpr double DEFAULT_LOAD_FACTOR = 0.8;
+    typedef FlatKeyGroup<Key> Group;
+
+    std::vector<Key> keys;          // capacity + 1 keys, the last one is always EMPTY_KEY
+    std::vector<Value> values;      // capacity + 1 values, the last one is the value of EMPTY_KEY
+    size_t capacity;                // number of slots, a prime in HashPrime
+    size_t primeIndex;              // capacity == HashPrime::g_a_sizes[primeIndex]
+    size_t tableSize = 0;           // number of elements, including EMPTY_KEY
+    bool hasEmptyKey = false;       // whether EMPTY_KEY is inserted
+    double maxLoadFactor = DEFAULT_LOAD_FACTOR;
+    Hash hash;
+
+    /**
+     * Time Complexity: O(1)
+     * @param key
+     * @return the slot where the probe of key starts
+     */
+    inline size_t homeSlot(Key key) const {
+        return HashPrime::g_a_mods[primeIndex](hash(key));
+    }
+
+    /**
+     * Find the slot of key, or the empty slot where the probe of key stops
+     * Time Complexity: Amortized O(1)
+     * @param key must not be EMPTY_KEY
+     * @return (whether key is found, the slot)
+     */
+    std::pair<bool, size_t> probe(Key key) const {
+        size_t slot = homeSlot(key);
+        while (true) {
+            if (slot + Group::GROUP_SIZE <= capacity) {
+                // Compare a whole group of keys
+                uint32_t equal = Group::match(&keys[slot], key);
+                if (equal) return {true, slot + Group::first(equal)};
+                uint32_t empty = Group::match(&keys[slot], EMPTY_KEY);
+                if (empty) return {false, slot + Group::first(empty)};
+                slot += Group::GROUP_SIZE;
+                if (slot == capacity) slot = 0;
+            } else {
+                // The group would pass the end of the table, compare one by one and wrap around
+                if (keys[slot] == key) return {true, slot};
+                if (keys[slot] == EMPTY_KEY) return {false, slot};
+                if (++slot == capacity) slot = 0;
+            }
+        }
+    }
+
+    /**
+     * Allocate the slots for a capacity, all slots are empty
+     * Time Complexity: O(capacity)
+     * @throw std::range_error if index is not in HashPrime
+     * @param index index of the capacity in HashPrime
+     */
+    void allocate(size_t index) {
+        if (index >= HashPrime::num_distinct_sizes_64_bit) throw std::range_error("No such bucket size found!");
+        primeIndex = index;
+        capacity = HashPrime::g_a_sizes[index];
+        keys.assign(capacity + 1, EMPTY_KEY);
+        values.assign(capacity + 1, Value());
+    }
+
+    /**
+     * Find the minimum capacity in HashPrime that holds count elements under the maximum load factor
+     * Time Complexity: O(1)
+     * @throw std::range_error if no such capacity can be found
+     * @param count
+     * @return index of the capacity in HashPrime
+     */
+    size_t findMinimumCapacityIndex(size_t count) const {
+        double minimum = std::floor((double) count / maxLoadFactor) + 1;
+        if (minimum >= (double) HashPrime::g_a_sizes[HashPrime::num_distinct_sizes_64_bit - 1]) {
+            throw std::range_error("No such bucket size found!");
+        }
+        // keep at least one empty slot so that every probe stops
+        return HashPrime::lowerBoundIndex(std::max((size_t) minimum, count + 1));
+    }
+
+public:
+    FlatHashTable() { allocate(0); }
+
+    explicit FlatHashTable(size_t bucketSize) {
+        allocate(HashPrime::lowerBoundIndex(bucketSize));
+    }
+
+    Iterator begin() {
+        Iterator it(this, 0);
+        it.skipEmpty();
+        return it;
+    }
+
+    Iterator end() { return Iterator(this, capacity + 1); }
+
+    /**
+     * Find the value in hashtable by key
+     * Time Complexity: Amortized O(1)
+     * @param key
+     * @return iterator of the value, or end() if the key doesn't exist
+     */
+    Iterator find(Key key) {
+        if (key == EMPTY_KEY) return hasEmptyKey ? Iterator(this, capacity) : end();
+        auto result = probe(key);
+        return result.first ? Iterator(this, result.second) : end();
+    }
+
+    /**
+     * Time Complexity: Amortized O(1)
+     * @param key
+     * @return whether the key exists in the hashtable
+     */
+    bool contains(Key key) const {
+        if (key == EMPTY_KEY) return hasEmptyKey;
+        return probe(key).first;
+    }
+
+    /**
+     * Insert <key, value> into the hashtable
+     * If the key already exists, overwrite its value
+     * If load factor exceeds maximum value, rehash the hashtable
+     * Time Complexity: Amortized O(1)
+     * @param key
+     * @param value
+     * @return whether insertion took place (return false if the key already exists)
+     */
+    bool insert(Key key, const Value &value) {
+        if (key == EMPTY_KEY) {
+            values[capacity] = value;
+            if (hasEmptyKey) return false;
+            hasEmptyKey = true;
+            tableSize++;
+            return true;
+        }
+        auto result = probe(key);
+        if (result.first) {
+            values[result.second] = value;
+            return false;
+        }
+        if ((double) (tableSize - hasEmptyKey + 1) > maxLoadFactor * (double) capacity ||
+            tableSize - hasEmptyKey + 1 == capacity) {
+            rehash(capacity + 1);
+            result = probe(key);
+        }
+        keys[result.second] = key;
+        values[result.second] = value;
+        tableSize++;
+        return true;
+    }
+
+    /**
+     * Erase the key if it exists in the hashtable, otherwise, do nothing
+     * The following keys of the probe are shifted backward, so no tombstone is left
+     * Time Complexity: Amortized O(1)
+     * @param key
+     * @return whether the key exists
+     */
+    bool erase(Key key) {
+        if (key == EMPTY_KEY) {
+            if (!hasEmptyKey) return false;
+            hasEmptyKey = false;
+            tableSize--;
+            return true;
+        }
+        auto result = probe(key);
+        if (!result.first) return false;
+
+        size_t hole = result.second;
+        size_t slot = hole;
+        while (true) {
+            if (++slot == capacity) slot = 0;
+            if (keys[slot] == EMPTY_KEY) break;
+            // The key at slot can fill the hole only if its home slot is not in (hole, slot]
+            size_t home = homeSlot(keys[slot]);
+            bool stays = hole <= slot ? (hole < home && home <= slot) : (hole < home || home <= slot);
+            if (stays) continue;
+            keys[hole] = keys[slot];
+            values[hole] = values[slot];
+            hole = slot;
+        }
+        keys[hole] = EMPTY_KEY;
+        tableSize--;
+        return true;
+    }
+
+    /**
+     * Get the reference of value by key in the hashtable
+     * If the key doesn't exist, create it first (use default constructor of Value)
+     * Time Complexity: Amortized O(1)
+     * @param key
+     * @return reference of value
+     */
+    Value &operator[](Key key) {
+        if (key == EMPTY_KEY || !probe(key).first) insert(key, Value());
+        return (*find(key)).second;
+    }
+
+    /**
+     * Rehash the hashtable according to the (hinted) number of slots
+     * The capacity after rehash is the minimum prime in HashPrime not less than bucketSize
+     * that holds all elements under the maximum load factor
+     * Time Complexity: O(n + capacity)
+     * @param bucketSize lower bound of the new number of slots
+     */
+    void rehash(size_t bucketSize) {
+        size_t index = std::max(HashPrime::lowerBoundIndex(bucketSize), findMinimumCapacityIndex(tableSize));
+        if (index == primeIndex) return;
+        std::vector<Key> oldKeys;
+        std::vector<Value> oldValues;
+        oldKeys.swap(keys);
+        oldValues.swap(values);
+        size_t oldCapacity = capacity;
+        allocate(index);
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (oldKeys[i] == EMPTY_KEY) continue;
+            size_t slot = probe(oldKeys[i]).second;
+            keys[slot] = oldKeys[i];
+            values[slot] = oldValues[i];
+        }
+        values[capacity] = oldValues[oldCapacity];
+    }
+
+    /**
+     * @return the number of elements in the hashtable
+     */
+    size_t size() const { return tableSize; }
+
+    /**
+     * @return the number of slots in the hashtable
+     */
+    size_t bucketSize() const { return capacity; }
+
+    /**
+     * @return the current load factor of the hashtable
+     */
+    double loadFactor() const { return (double) tableSize / (double) capacity; }
+
+    /**
+     * @return the maximum load factor of the hashtable
+     */
+    double getMaxLoadFactor() const { return maxLoadFactor; }
+
+    /**
+     * Set the max load factor
+     * @throw std::range_error if the load factor is not in (0, 1)
+     * @param loadFactor
+     */
+    void setMaxLoadFactor(double loadFactor) {
+        if (loadFactor <= 1e-9 || loadFactor >= 1) {
+            throw std::range_error("invalid load factor!");
+        }
+        maxLoadFactor = loadFactor;
+        rehash(capacity);
+    }
+
+    /**
+     * @return the number of bytes used by the slots
+     */
+    size_t memoryUsage() const {
+        return sizeof(*this) + keys.capacity() * sizeof(Key) + values.capacity() * sizeof(Value);
+    }
+};
+
+/**
+ * Select the hashtable for a <Key, Value> pair
+ * FlatHashTable if IsCompactHashable, otherwise HashTable
+ */
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+struct HashTableSelector {
+    typedef std::conditional_t<IsCompactHashable<Key, Value>::value,
+            FlatHashTable<Key, Value, Hash>, HashTable<Key, Value, Hash>> type;
+};
+
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+using CompactHashTable = typename HashTableSelector<Key, Value, Hash>::type;
+
+#endif //VE281P2_FLAT_HASHTABLE_HPP
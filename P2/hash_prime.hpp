@@ -1,5 +1,9 @@
+#ifndef VE281P2_HASH_PRIME_HPP
+#define VE281P2_HASH_PRIME_HPP
+
 // adopted from /usr/include/c++/10.2.0/ext/pb_ds/detail/resize_policy/hash_prime_size_policy_imp.hpp
 
+#include <array>
 #include <utility>
 
 namespace HashPrime {
@@ -77,4 +81,76 @@ namespace HashPrime {
             /* 61    */ (std::size_t) 18446744073709551557ull,
     };
 
+    /**
+     * hash % g_a_sizes[I] with a compile-time constant divisor
+     * The compiler lowers a constant modulo to multiplies and shifts (fastmod),
+     * which avoids a 64-bit hardware division on every lookup
+     */
+    template<std::size_t I>
+    constexpr std::size_t mod(std::size_t hash) {
+        return hash % g_a_sizes[I];
+    }
+
+    template<std::size_t... I>
+    constexpr std::array<std::size_t (*)(std::size_t), sizeof...(I)> makeModTable(std::index_sequence<I...>) {
+        return {{&mod<I>...}};
+    }
+
+    // g_a_mods[i](hash) == hash % g_a_sizes[i]
+    static constexpr auto g_a_mods = makeModTable(std::make_index_sequence<num_distinct_sizes_64_bit>());
+
+    /**
+     * @return number of bits needed to represent n
+     */
+    constexpr std::size_t bitWidth(unsigned long long n) {
+#if defined(__GNUC__) || defined(__clang__)
+        return n == 0 ? 0 : 64 - __builtin_clzll(n);
+#else
+        std::size_t width = 0;
+        for (; n; n >>= 1) width++;
+        return width;
+#endif
+    }
+
+    struct WidthTable {
+        // first[w] is the index of the first size in g_a_sizes with a bit width of at least w
+        std::size_t first[65];
+        // maximum number of sizes in g_a_sizes that share a bit width
+        std::size_t maxShared;
+    };
+
+    constexpr WidthTable makeWidthTable() {
+        WidthTable table{};
+        std::size_t i = 0;
+        for (std::size_t width = 0; width <= 64; width++) {
+            while (i < num_distinct_sizes_64_bit && bitWidth(g_a_sizes[i]) < width) i++;
+            table.first[width] = i;
+            std::size_t j = i;
+            while (j < num_distinct_sizes_64_bit && bitWidth(g_a_sizes[j]) == width) j++;
+            if (j - i > table.maxShared) table.maxShared = j - i;
+        }
+        return table;
+    }
+
+    static constexpr WidthTable g_a_width_table = makeWidthTable();
+
+    // the sizes roughly double, so lowerBoundIndex checks at most maxShared sizes
+    static_assert(g_a_width_table.maxShared <= 2, "g_a_sizes grows too slowly");
+
+    /**
+     * Find the index of the minimum size in g_a_sizes that is not less than n
+     * Start from the first size with the same bit width as n, then only the few
+     * sizes sharing that bit width need to be checked
+     * Time Complexity: O(1)
+     * @param n
+     * @return the index, or num_distinct_sizes_64_bit if n is greater than all sizes
+     */
+    constexpr std::size_t lowerBoundIndex(std::size_t n) {
+        std::size_t i = g_a_width_table.first[bitWidth(n)];
+        while (i < num_distinct_sizes_64_bit && g_a_sizes[i] < n) i++;
+        return i;
+    }
+
 }
+
+#endif //VE281P2_HASH_PRIME_HPP
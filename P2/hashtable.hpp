@@ -1,10 +1,70 @@
+#ifndef VE281P2_HASHTABLE_HPP
+#define VE281P2_HASHTABLE_HPP
+
 #include "hash_prime.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <exception>
 #include <functional>
 #include <vector>
 #include <forward_list>
 #include <iostream>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+// hint the cpu to fetch the cache line of addr, used by the batched lookups
+#if defined(__GNUC__) || defined(__clang__)
+#define HASHTABLE_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define HASHTABLE_PREFETCH(addr) ((void) (addr))
+#endif
+
+// define HASHTABLE_STATS before including this file to count lookups and rehashes,
+// otherwise the counters are compiled out
+#ifdef HASHTABLE_STATS
+#define HASHTABLE_COUNT(statement) statement
+#else
+#define HASHTABLE_COUNT(statement) ((void) 0)
+#endif
+
+/**
+ * Statistics of a hashtable, returned by HashTable::statistics
+ * The counters are only collected if HASHTABLE_STATS is defined, otherwise they are always 0
+ */
+struct HashTableStats {
+    size_t size = 0;                        // number of elements
+    size_t bucketSize = 0;                  // number of buckets
+    double loadFactor = 0;
+    size_t emptyBuckets = 0;
+    double emptyBucketRatio = 0;
+    size_t maxChain = 0;                    // length of the longest bucket
+    double averageChain = 0;                // average length of the non-empty buckets
+    std::vector<size_t> chainHistogram;     // chainHistogram[i] is the number of buckets of length i
+
+    size_t lookups = 0;                     // bucket searches, including the ones done by insert
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t probes = 0;                      // nodes compared by all lookups
+    size_t rehashCount = 0;
+    double rehashSeconds = 0;               // total duration of all rehashes
+};
+
+/**
+ * A transparent hash function for string keys
+ * std::string, std::string_view and const char * with the same content get the same hash value,
+ * so a HashTable<std::string, Value, StringHash, std::equal_to<>> can be searched
+ * without constructing a std::string
+ */
+struct StringHash {
+    typedef void is_transparent;
+
+    size_t operator()(std::string_view str) const { return std::hash<std::string_view>()(str); }
+};
 
 /**
  * The Hashtable class
@@ -15,26 +75,47 @@
  * @tparam Value        data type
  * @tparam Hash         function object, return the hash value of a key
  * @tparam KeyEqual     function object, return whether two keys are the same
+ * @tparam CacheHash    whether to store the full hash value in each node, so that rehash never
+ *                      calls Hash again and lookups reject mismatched keys without calling KeyEqual
+ *
+ * If both Hash and KeyEqual define is_transparent (e.g. StringHash and std::equal_to<>),
+ * find and contains also accept any type comparable with Key (heterogeneous lookup)
  */
 template<
         typename Key, typename Value,
         typename Hash = std::hash<Key>,
-        typename KeyEqual = std::equal_to<Key>
+        typename KeyEqual = std::equal_to<Key>,
+        bool CacheHash = false
 >
 class HashTable {
 public:
     typedef std::pair<const Key, Value> HashNode;
-    typedef std::forward_list<HashNode> HashNodeList;
+
+    // A node with its cached hash value, used when CacheHash is true
+    struct CachedHashNode : HashNode {
+        size_t hashCode;
+
+        CachedHashNode(size_t hashCode, const Key &key, const Value &value) :
+                HashNode(key, value), hashCode(hashCode) {}
+    };
+
+    typedef std::conditional_t<CacheHash, CachedHashNode, HashNode> StoredNode;
+    typedef std::forward_list<StoredNode> HashNodeList;
     typedef std::vector<HashNodeList> HashTableData;
 
     /**
      * A single directional iterator for the hashtable
-     * ! DO NOT NEED TO MODIFY THIS !
+     * Iterator can modify the values, ConstIterator is returned by the const member functions
+     * @tparam Const whether the elements are read only
      */
-    class Iterator {
+    template<bool Const>
+    class IteratorBase {
     private:
-        typedef typename HashTableData::iterator VectorIterator;
-        typedef typename HashNodeList::iterator ListIterator;
+        typedef std::conditional_t<Const, typename HashTableData::const_iterator,
+                typename HashTableData::iterator> VectorIterator;
+        typedef std::conditional_t<Const, typename HashNodeList::const_iterator,
+                typename HashNodeList::iterator> ListIterator;
+        typedef std::conditional_t<Const, const HashNode, HashNode> Node;
 
         const HashTable *hashTable;
         VectorIterator bucketIt;    // an iterator of the buckets， which bucket the iterator is in
@@ -43,41 +124,32 @@ public:
 
         /**
          * Increment the iterator
+         * The list is only walked once, empty buckets are skipped with the occupied bitmap
          * Time complexity: Amortized O(1)
          */
         void increment() {
-            if (bucketIt == hashTable->buckets.end()) { 
+            if (bucketIt == hashTable->buckets.end()) {
                 endFlag = true;
                 return;
             }
-            auto newListItBefore = listItBefore;
-            ++newListItBefore;
-            if (newListItBefore != bucketIt->end()) {
-                if (++newListItBefore != bucketIt->end()) {
-                    // use the next element in the current forward_list
-                    ++listItBefore;
-                    return;
-                }
+            auto listIt = std::next(listItBefore);
+            if (listIt != bucketIt->end() && std::next(listIt) != bucketIt->end()) {
+                // use the next element in the current forward_list
+                listItBefore = listIt;
+                return;
             }
-            while (++bucketIt != hashTable->buckets.end()) {
-                if (!bucketIt->empty()) {
-                    // use the first element in a new forward_list
-                    listItBefore = bucketIt->before_begin();
-                    return;
-                }
+            // use the first element in the next non-empty forward_list
+            size_t current = (size_t) (bucketIt - hashTable->buckets.begin());
+            bucketIt += (std::ptrdiff_t) (hashTable->nextOccupied(current + 1) - current);
+            if (bucketIt == hashTable->buckets.end()) {
+                endFlag = true;
+                return;
             }
-            endFlag = true;
-        }
-
-        // Constructor of Iterator
-        explicit Iterator(HashTable *hashTable) : hashTable(hashTable) {
-            bucketIt = hashTable->buckets.begin();
             listItBefore = bucketIt->before_begin();
-            endFlag = bucketIt == hashTable->buckets.end();
         }
 
         // Constructor of Iterator
-        Iterator(HashTable *hashTable, VectorIterator vectorIt, ListIterator listItBefore) :
+        IteratorBase(const HashTable *hashTable, VectorIterator vectorIt, ListIterator listItBefore) :
                 hashTable(hashTable), bucketIt(vectorIt), listItBefore(listItBefore) {
             endFlag = bucketIt == hashTable->buckets.end();
         }
@@ -85,79 +157,116 @@ public:
     public:
         friend class HashTable;
 
-        Iterator() = delete;
+        IteratorBase() = delete;
+
+        IteratorBase(const IteratorBase &) = default;
 
-        Iterator(const Iterator &) = default;
+        // Convert an Iterator to a ConstIterator
+        template<bool C = Const, typename = std::enable_if_t<C>>
+        IteratorBase(const IteratorBase<false> &that) :
+                hashTable(that.hashTable), bucketIt(that.bucketIt), listItBefore(that.listItBefore),
+                endFlag(that.endFlag) {}
 
-        Iterator &operator=(const Iterator &) = default;
+        IteratorBase &operator=(const IteratorBase &) = default;
 
-        Iterator &operator++() {
+        IteratorBase &operator++() {
             increment();
             return *this;
         }
 
-        Iterator operator++(int) {
-            Iterator temp = *this;
+        IteratorBase operator++(int) {
+            IteratorBase temp = *this;
             increment();
             return temp;
         }
 
-        bool operator==(const Iterator &that) const {
+        bool operator==(const IteratorBase &that) const {
             if (endFlag && that.endFlag) return true;
             if (bucketIt != that.bucketIt) return false;
             return listItBefore == that.listItBefore;
         }
 
-        bool operator!=(const Iterator &that) const {
+        bool operator!=(const IteratorBase &that) const {
             if (endFlag && that.endFlag) return false;
             if (bucketIt != that.bucketIt) return true;
             return listItBefore != that.listItBefore;
         }
 
-        HashNode *operator->() {
-            auto listIt = listItBefore;
-            ++listIt;
-            return &(*listIt);
+        Node *operator->() const {
+            return &*std::next(listItBefore);
         }
 
-        HashNode &operator*() {
-            auto listIt = listItBefore;
-            ++listIt;
-            return *listIt;
+        Node &operator*() const {
+            return *std::next(listItBefore);
         }
 
+        friend class IteratorBase<!Const>;
     };
 
+    typedef IteratorBase<false> Iterator;
+    typedef IteratorBase<true> ConstIterator;
+
 protected:                                                                  // DO NOT USE private HERE!
     static constexpr double DEFAULT_LOAD_FACTOR = 0.5;                      // default maximum load factor is 0.5
     static constexpr size_t DEFAULT_BUCKET_SIZE = HashPrime::g_a_sizes[0];  // default number of buckets is 5
+    static constexpr size_t BATCH_GROUP_SIZE = 16;                          // keys in flight per prefetch group
+    static constexpr size_t BULK_PARTITIONS = 1024;                         // maximum partitions of a bulk load
 
     HashTableData buckets;                                                  // buckets, of singly linked lists
+    std::vector<uint64_t> occupiedBuckets;                                  // bitmap, whether each bucket is non-empty
     typename HashTableData::iterator firstBucketIt;                         // help get begin iterator in O(1) time
+    size_t primeIndex;                                                      // buckets.size() == HashPrime::g_a_sizes[primeIndex]
 
     size_t tableSize;                                                       // number of elements
     double maxLoadFactor;                                                   // maximum load factor
     Hash hash;                                                              // hash function instance
     KeyEqual keyEqual;                                                      // key equal function instance
 
+#ifdef HASHTABLE_STATS
+    // Atomic, so that concurrent const lookups can count together
+    struct Counters {
+        std::atomic<size_t> lookups{0};
+        std::atomic<size_t> hits{0};
+        std::atomic<size_t> misses{0};
+        std::atomic<size_t> probes{0};
+        size_t rehashCount = 0;                                             // only written by rehash
+        double rehashSeconds = 0;
+    };
+    mutable Counters counters;
+#endif
+
     /**
-     * Time Complexity: O(k)
-     * @param key
-     * @param bucketSize
-     * @return the hash value of key with a new bucket size
+     * Time Complexity: O(1)
+     * @param hashCode the full hash value of a key
+     * @return the bucket of the hash value with current bucket size
      */
-    inline size_t hashKey(const Key &key, size_t bucketSize) const {
-        return hash(key) % bucketSize;
+    inline size_t bucketIndex(size_t hashCode) const {
+        return HashPrime::g_a_mods[primeIndex](hashCode);
     }
 
     /**
-     * Time Complexity: O(k)
+     * Time Complexity: O(1) if CacheHash, otherwise O(k)
+     * @param node
+     * @return the full hash value of the key in node
+     */
+    inline size_t nodeHash(const StoredNode &node) const {
+        if constexpr (CacheHash) return node.hashCode;
+        else return hash(node.first);
+    }
+
+    /**
+     * Time Complexity: O(1) if the cached hash values differ, otherwise O(k)
+     * @param node
      * @param key
-     * @return the hash value of key with current bucket size
+     * @param hashCode the full hash value of key
+     * @return whether the key in node is the same as key
      */
-    inline size_t hashKey(const Key &key) const {
-        if(buckets.size() == 0) return 0;
-        return hash(key) % buckets.size();
+    template<typename K>
+    inline bool nodeMatches(const StoredNode &node, const K &key, size_t hashCode) const {
+        if constexpr (CacheHash) {
+            if (node.hashCode != hashCode) return false;
+        }
+        return keyEqual(node.first, key);
     }
 
     /**
@@ -172,25 +281,192 @@ protected:                                                                  // D
      * @param bucketSize lower bound of the new number of buckets
      */
     size_t findMinimumBucketSize(size_t bucketSize) const {
-
-        size_t i;
-        for(i = 0; i < 62; i++){
-            size_t temp = HashPrime::g_a_sizes[i];
-            double t = (double)tableSize;
-            double a = t/maxLoadFactor;
-            size_t b = (size_t)a;
-            if(temp >= bucketSize && temp > b) break;
+        double minimum = std::floor((double) tableSize / maxLoadFactor) + 1;
+        if (minimum >= (double) HashPrime::g_a_sizes[HashPrime::num_distinct_sizes_64_bit - 1]) {
+            throw std::range_error("No such bucket size found!");
         }
-        if(i == 62) throw std::range_error("No such bucket size found!");
+        size_t i = HashPrime::lowerBoundIndex(std::max(bucketSize, (size_t) minimum));
+        if (i == HashPrime::num_distinct_sizes_64_bit) throw std::range_error("No such bucket size found!");
         return HashPrime::g_a_sizes[i];
     }
 
+    /**
+     * Set or clear the bit of a bucket in the occupied bitmap
+     * Time Complexity: O(1)
+     * @param index
+     * @param occupied
+     */
+    inline void markOccupied(size_t index, bool occupied) {
+        if (occupied) occupiedBuckets[index / 64] |= uint64_t(1) << (index % 64);
+        else occupiedBuckets[index / 64] &= ~(uint64_t(1) << (index % 64));
+    }
+
+    /**
+     * Find the first non-empty bucket from index with the occupied bitmap
+     * Time Complexity: O(number of empty buckets skipped / 64)
+     * @param index
+     * @return index of the first non-empty bucket not before index, or buckets.size() if there is none
+     */
+    size_t nextOccupied(size_t index) const {
+        if (index >= buckets.size()) return buckets.size();
+        size_t word = index / 64;
+        uint64_t bits = occupiedBuckets[word] & (~uint64_t(0) << (index % 64));
+        while (!bits) {
+            if (++word == occupiedBuckets.size()) return buckets.size();
+            bits = occupiedBuckets[word];
+        }
+#if defined(__GNUC__) || defined(__clang__)
+        return word * 64 + (size_t) __builtin_ctzll(bits);
+#else
+        size_t bit = 0;
+        while (!(bits >> bit & 1)) bit++;
+        return word * 64 + bit;
+#endif
+    }
+
+    /**
+     * Search the key in a single bucket, without touching other buckets
+     * Time Complexity: O(k * length of the bucket)
+     * @param bucketIt the bucket the key is hashed to, a const_iterator gives a ConstIterator
+     * @param key
+     * @param hashCode the full hash value of key
+     * @return iterator of the key if found, otherwise the insert position with endFlag = true
+     */
+    template<typename VectorIterator, typename K>
+    auto findInBucket(VectorIterator bucketIt, const K &key, size_t hashCode) const {
+        typedef IteratorBase<std::is_same<VectorIterator, typename HashTableData::const_iterator>::value> It;
+        HASHTABLE_COUNT(counters.lookups++);
+        auto listItBefore = bucketIt->before_begin();
+        for (auto listIt = bucketIt->begin(); listIt != bucketIt->end(); listItBefore = listIt++) {
+            HASHTABLE_COUNT(counters.probes++);
+            if (nodeMatches(*listIt, key, hashCode)) {
+                HASHTABLE_COUNT(counters.hits++);
+                return It(this, bucketIt, listItBefore);
+            }
+        }
+        HASHTABLE_COUNT(counters.misses++);
+        It it(this, bucketIt, listItBefore);
+        it.endFlag = true;
+        return it;
+    }
+
+    /**
+     * Hash a group of keys and prefetch their buckets (group prefetching)
+     * The first pass computes all bucket indices and prefetches the bucket slots,
+     * the second pass prefetches the head node of each non-empty bucket,
+     * so the cache misses of independent keys overlap instead of stalling one by one
+     * Time Complexity: O(k * count)
+     * @param items keys, or elements that contain the keys
+     * @param count number of items, at most BATCH_GROUP_SIZE
+     * @param hashCodes output full hash values
+     * @param indices output bucket indices
+     * @param keyOf function object, return the key of an item
+     */
+    template<typename Item, typename KeyOf>
+    void prefetchGroup(const Item *items, size_t count, size_t *hashCodes, size_t *indices, KeyOf keyOf) const {
+        for (size_t i = 0; i < count; i++) {
+            hashCodes[i] = hash(keyOf(items[i]));
+            indices[i] = bucketIndex(hashCodes[i]);
+            HASHTABLE_PREFETCH(&buckets[indices[i]]);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (!buckets[indices[i]].empty()) HASHTABLE_PREFETCH(&buckets[indices[i]].front());
+        }
+    }
+
+    /**
+     * Insert value according to an iterator returned by find, with the hash value of key known
+     * Time Complexity: O(k)
+     * @param it an iterator returned by find
+     * @param hashCode the full hash value of key
+     * @param key
+     * @param value
+     * @return whether insertion took place (return false if the key already exists)
+     */
+    bool insertWithHash(const Iterator &it, size_t hashCode, const Key &key, const Value &value) {
+        // Update
+        if(it.endFlag == 0){
+            std::next(it.listItBefore)->second = value;
+            return false;
+        }
+        // If it does not exist, insert it at the back of this bucket
+        if constexpr (CacheHash) it.bucketIt->emplace_after(it.listItBefore, hashCode, key, value);
+        else it.bucketIt->emplace_after(it.listItBefore, key, value);
+        this->tableSize++;
+        markOccupied((size_t) (it.bucketIt - buckets.begin()), true);
+
+        // Update the firstBucketIt, only if the new element is before the current first one
+        if (this->firstBucketIt == this->buckets.end() || it.bucketIt < this->firstBucketIt) {
+            this->firstBucketIt = it.bucketIt;
+        }
+
+        // If load factor exceeds maximum value, rehash the hashtable
+        if(this->loadFactor() > this->maxLoadFactor) this->rehash(this->buckets.size());
+
+        return true;
+    }
+
+
+    /**
+     * Run function(0), function(1), ..., function(threads - 1), each one in its own thread
+     * @param threads
+     * @param function
+     */
+    template<typename Function>
+    static void parallelFor(size_t threads, Function function) {
+        if (threads <= 1) {
+            function(0);
+            return;
+        }
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < threads; t++) workers.emplace_back(function, t);
+        function(0);
+        for (auto &worker : workers) worker.join();
+    }
+
+    /**
+     * Insert the items of a bulk load whose buckets are in a partition
+     * Partitions are ranges of whole 64-bucket words of the occupied bitmap, so different
+     * partitions can be inserted by different threads without sharing any memory
+     * The counters of HASHTABLE_STATS are not updated
+     * Time Complexity: O(k * number of items)
+     * @param pairs all items of the bulk load
+     * @param hashCodes full hash values of the items
+     * @param first indices of the items in this partition, in input order
+     * @param last
+     * @return number of insertions took place
+     */
+    size_t insertPartition(const std::vector<std::pair<Key, Value>> &pairs, const std::vector<size_t> &hashCodes,
+                           const size_t *first, const size_t *last) {
+        size_t inserted = 0;
+        for (; first != last; ++first) {
+            const auto &pair = pairs[*first];
+            size_t hashCode = hashCodes[*first];
+            size_t index = bucketIndex(hashCode);
+            auto &bucket = buckets[index];
+            auto listItBefore = bucket.before_begin();
+            bool found = false;
+            for (auto listIt = bucket.begin(); listIt != bucket.end(); listItBefore = listIt++) {
+                if (nodeMatches(*listIt, pair.first, hashCode)) {
+                    listIt->second = pair.second;
+                    found = true;
+                    break;
+                }
+            }
+            if (found) continue;
+            if constexpr (CacheHash) bucket.emplace_after(listItBefore, hashCode, pair.first, pair.second);
+            else bucket.emplace_after(listItBefore, pair.first, pair.second);
+            markOccupied(index, true);
+            inserted++;
+        }
+        return inserted;
+    }
 
 public:
     // Constructor
     HashTable() :
-            buckets(DEFAULT_BUCKET_SIZE), tableSize(0), maxLoadFactor(DEFAULT_LOAD_FACTOR),
-            hash(Hash()), keyEqual(KeyEqual()) {
+            buckets(DEFAULT_BUCKET_SIZE), occupiedBuckets((DEFAULT_BUCKET_SIZE + 63) / 64, 0), primeIndex(0),
+            tableSize(0), maxLoadFactor(DEFAULT_LOAD_FACTOR), hash(Hash()), keyEqual(KeyEqual()) {
         firstBucketIt = buckets.end(); // why it's the end iterator? It's empty.
     }
 
@@ -200,40 +476,44 @@ public:
             hash(Hash()), keyEqual(KeyEqual()) {
         bucketSize = findMinimumBucketSize(bucketSize);
         buckets.resize(bucketSize);
+        occupiedBuckets.assign((bucketSize + 63) / 64, 0);
+        primeIndex = HashPrime::lowerBoundIndex(bucketSize);
         firstBucketIt = buckets.end(); // why it's the end iterator? It's empty.
     }
 
-    HashTable(const HashTable &that){
-        // Copy basic attributes
-        this->buckets.clear();
-        this->buckets.resize(that.bucketSize());
-
-        tableSize = that.size();
-        maxLoadFactor = that.getMaxLoadFactor();
-        hash = that.hash;
-        keyEqual = that.keyEqual;
-
-        // Copy all buckets
-        for(size_t i = 0; i < that.buckets.size(); i++) this->buckets[i] = that.buckets[i];
-            
+    HashTable(const HashTable &that) :
+            buckets(that.buckets), occupiedBuckets(that.occupiedBuckets), primeIndex(that.primeIndex),
+            tableSize(that.tableSize), maxLoadFactor(that.maxLoadFactor), hash(that.hash), keyEqual(that.keyEqual) {
+        // Point to the same bucket in the copied buckets
+        firstBucketIt = buckets.begin() + (that.firstBucketIt - that.buckets.begin());
     }
 
     HashTable &operator=(const HashTable &that) {
+        if (this == &that) return *this;
         // Copy basic attributes
-        this->buckets.clear();
-        this->buckets.resize(that.bucketSize());
-
-        tableSize = that.size();
-        maxLoadFactor = that.getMaxLoadFactor();
+        buckets = that.buckets;
+        occupiedBuckets = that.occupiedBuckets;
+        primeIndex = that.primeIndex;
+        tableSize = that.tableSize;
+        maxLoadFactor = that.maxLoadFactor;
         hash = that.hash;
         keyEqual = that.keyEqual;
 
-        // Copy all buckets
-        for(size_t i = 0; i < that.buckets.size(); i++) this->buckets[i] = that.buckets[i];
-
+        // Point to the same bucket in the copied buckets
+        firstBucketIt = buckets.begin() + (that.firstBucketIt - that.buckets.begin());
         return (*this);
     };
 
+    /**
+     * Construct the hashtable from a batch of <key, value> pairs with insertRange
+     * Time Complexity: O(nk / threads + n)
+     * @param pairs
+     * @param threads number of threads used to insert, 0 for all hardware threads
+     */
+    explicit HashTable(const std::vector<std::pair<Key, Value>> &pairs, size_t threads = 1) : HashTable() {
+        insertRange(pairs, threads);
+    }
+
     ~HashTable() = default;
 
     Iterator begin() {
@@ -247,6 +527,18 @@ public:
         return Iterator(this, buckets.end(), buckets.begin()->before_begin());
     }
 
+    ConstIterator begin() const {
+        if (firstBucketIt != buckets.end()) {
+            auto bucketIt = buckets.cbegin() + (firstBucketIt - buckets.begin());
+            return ConstIterator(this, bucketIt, bucketIt->before_begin());
+        }
+        return end();
+    }
+
+    ConstIterator end() const {
+        return ConstIterator(this, buckets.cend(), buckets.cbegin()->before_begin());
+    }
+
     /**
      * 
      * Find whether the key exists in the hashtable
@@ -254,7 +546,19 @@ public:
      * @param key
      * @return whether the key exists in the hashtable
      */
-    bool contains(const Key &key) {
+    bool contains(const Key &key) const {
+        return find(key) != end();
+    }
+
+    /**
+     * Find whether a key of another type exists in the hashtable (heterogeneous lookup)
+     * Time Complexity: Amortized O(k)
+     * @param key any type that Hash accepts and KeyEqual compares with Key
+     * @return whether the key exists in the hashtable
+     */
+    template<typename K, typename H = Hash, typename E = KeyEqual,
+            typename = typename H::is_transparent, typename = typename E::is_transparent>
+    bool contains(const K &key) const {
         return find(key) != end();
     }
 
@@ -267,27 +571,49 @@ public:
      * @return a pair (success, iterator of the value)
      */
     Iterator find(const Key &key) {
-        // Calculate the hash key
-        size_t index = hashKey(key);
-        
-        this->firstBucketIt = this->buckets.begin() + index;
-
-        Iterator it1 = this->begin();
-        Iterator it2 = this->begin();
-
-        // Search for the pair in this bucket according to the given key
-        it1.listItBefore++;
-        while(it1.listItBefore != it1.bucketIt->end()){
-            // If find the key
-            if(it1.listItBefore->first == key){
-                it2.endFlag = false;
-                return it2;
-            }
-            it2.listItBefore++;
-            it1.listItBefore++;
-        }
-        it2.endFlag = true;
-        return it2;
+        size_t hashCode = hash(key);
+        return findInBucket(buckets.begin() + bucketIndex(hashCode), key, hashCode);
+    }
+
+    /**
+     * Find the value in a const hashtable by key
+     * Only the bucket of the key is read, so concurrent calls are safe without writers
+     * (the counters of HASHTABLE_STATS are atomic)
+     * Time Complexity: Amortized O(k)
+     * @param key
+     * @return iterator of the value, or end() if the key doesn't exist
+     */
+    ConstIterator find(const Key &key) const {
+        size_t hashCode = hash(key);
+        return findInBucket(buckets.cbegin() + bucketIndex(hashCode), key, hashCode);
+    }
+
+    /**
+     * Find the value in hashtable by a key of another type (heterogeneous lookup)
+     * Only available if both Hash and KeyEqual are transparent, no Key is constructed
+     * Time Complexity: Amortized O(k)
+     * @param key any type that Hash accepts and KeyEqual compares with Key
+     * @return same as find(const Key &)
+     */
+    template<typename K, typename H = Hash, typename E = KeyEqual,
+            typename = typename H::is_transparent, typename = typename E::is_transparent>
+    Iterator find(const K &key) {
+        size_t hashCode = hash(key);
+        return findInBucket(buckets.begin() + bucketIndex(hashCode), key, hashCode);
+    }
+
+    /**
+     * Find the value in a const hashtable by a key of another type (heterogeneous lookup)
+     * Same as find(const Key &) const, without constructing a Key
+     * Time Complexity: Amortized O(k)
+     * @param key any type that Hash accepts and KeyEqual compares with Key
+     * @return iterator of the value, or end() if the key doesn't exist
+     */
+    template<typename K, typename H = Hash, typename E = KeyEqual,
+            typename = typename H::is_transparent, typename = typename E::is_transparent>
+    ConstIterator find(const K &key) const {
+        size_t hashCode = hash(key);
+        return findInBucket(buckets.cbegin() + bucketIndex(hashCode), key, hashCode);
     }
 
     /**
@@ -303,23 +629,7 @@ public:
      * @return whether insertion took place (return false if the key already exists)
      */
     bool insert(const Iterator &it, const Key &key, const Value &value) {
-        // Update
-        if(it.endFlag == 0){
-            std::next(it.listItBefore)->second = value;
-            return false;
-        }
-        // If it does not exist, insert it at the back of this bucket
-        HashNode new_node(key, value);
-        it.bucketIt->insert_after(it.listItBefore, new_node);
-        this->tableSize++;
-
-        // Update the firstBucketIt
-        this->firstBucketIt = it.bucketIt;
-
-        // If load factor exceeds maximum value, rehash the hashtable
-        if(this->loadFactor() > this->maxLoadFactor) this->rehash(this->buckets.size());
-
-        return true;
+        return insertWithHash(it, CacheHash && it.endFlag ? hash(key) : 0, key, value);
     }
 
     /**
@@ -333,8 +643,139 @@ public:
      * @return whether insertion took place (return false if the key already exists)
      */
     bool insert(const Key &key, const Value &value) {
-        Iterator it = this->find(key);
-        return insert(it, key, value);
+        size_t hashCode = hash(key);
+        Iterator it = findInBucket(buckets.begin() + bucketIndex(hashCode), key, hashCode);
+        return insertWithHash(it, hashCode, key, value);
+    }
+
+    /**
+     * Find a batch of keys, overlapping the cache misses of independent lookups
+     * Keys are processed in groups of BATCH_GROUP_SIZE: all keys of a group are
+     * hashed and prefetched before any of them is resolved
+     * Time Complexity: Amortized O(k * keys.size())
+     * @param keys
+     * @return iterators in the same order as keys, each one is the same as find(key)
+     */
+    std::vector<Iterator> findMany(const std::vector<Key> &keys) {
+        std::vector<Iterator> result;
+        result.reserve(keys.size());
+        size_t hashCodes[BATCH_GROUP_SIZE], indices[BATCH_GROUP_SIZE];
+        for (size_t first = 0; first < keys.size(); first += BATCH_GROUP_SIZE) {
+            size_t count = std::min(BATCH_GROUP_SIZE, keys.size() - first);
+            prefetchGroup(&keys[first], count, hashCodes, indices, [](const Key &key) -> const Key & { return key; });
+            for (size_t i = 0; i < count; i++) {
+                result.push_back(findInBucket(buckets.begin() + indices[i], keys[first + i], hashCodes[i]));
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Find whether each key of a batch exists in the hashtable
+     * Time Complexity: Amortized O(k * keys.size())
+     * @param keys
+     * @return whether each key exists, in the same order as keys
+     */
+    std::vector<bool> containsMany(const std::vector<Key> &keys) const {
+        std::vector<bool> result;
+        result.reserve(keys.size());
+        size_t hashCodes[BATCH_GROUP_SIZE], indices[BATCH_GROUP_SIZE];
+        for (size_t first = 0; first < keys.size(); first += BATCH_GROUP_SIZE) {
+            size_t count = std::min(BATCH_GROUP_SIZE, keys.size() - first);
+            prefetchGroup(&keys[first], count, hashCodes, indices, [](const Key &key) -> const Key & { return key; });
+            for (size_t i = 0; i < count; i++) {
+                result.push_back(!findInBucket(buckets.cbegin() + indices[i], keys[first + i], hashCodes[i]).endFlag);
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Insert a batch of <key, value> pairs into the hashtable
+     * If a key already exists (or appears twice in the batch), the later value overwrites
+     * The hashtable is rehashed at most once, before the batch, so that bucket indices
+     * computed for a group stay valid while the group is inserted
+     * Time Complexity: Amortized O(k * pairs.size())
+     * @param pairs
+     * @return number of insertions took place (keys that did not exist before)
+     */
+    size_t insertMany(const std::vector<std::pair<Key, Value>> &pairs) {
+        if (pairs.empty()) return 0;
+        rehash(static_cast<size_t>(std::ceil((double) (tableSize + pairs.size()) / maxLoadFactor)));
+
+        size_t inserted = 0;
+        size_t hashCodes[BATCH_GROUP_SIZE], indices[BATCH_GROUP_SIZE];
+        for (size_t first = 0; first < pairs.size(); first += BATCH_GROUP_SIZE) {
+            size_t count = std::min(BATCH_GROUP_SIZE, pairs.size() - first);
+            prefetchGroup(&pairs[first], count, hashCodes, indices,
+                          [](const std::pair<Key, Value> &pair) -> const Key & { return pair.first; });
+            for (size_t i = 0; i < count; i++) {
+                const auto &pair = pairs[first + i];
+                Iterator it = findInBucket(buckets.begin() + indices[i], pair.first, hashCodes[i]);
+                if (insertWithHash(it, hashCodes[i], pair.first, pair.second)) inserted++;
+            }
+        }
+        return inserted;
+    }
+
+    /**
+     * Bulk load a batch of <key, value> pairs
+     * 1. Rehash once, with findMinimumBucketSize, so that the whole batch fits
+     * 2. Hash all keys, and radix partition them by bucket into at most BULK_PARTITIONS
+     *    ranges of buckets (a stable counting sort, so the input order is kept in each range)
+     * 3. Insert the partitions, optionally in parallel; nodes of neighbouring buckets are
+     *    allocated together, and each key is only searched once
+     * If a key already exists (or appears twice in the batch), the later value overwrites
+     * Time Complexity: O(nk / threads + n + number of buckets / 64)
+     * @param pairs
+     * @param threads number of threads used to hash and insert, 0 for all hardware threads
+     * @return number of duplicates, i.e. pairs whose key already existed or appeared earlier in the batch
+     */
+    size_t insertRange(const std::vector<std::pair<Key, Value>> &pairs, size_t threads = 1) {
+        if (pairs.empty()) return 0;
+        if (threads == 0) threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        rehash(static_cast<size_t>(std::ceil((double) (tableSize + pairs.size()) / maxLoadFactor)));
+
+        // Each partition is a range of whole bitmap words
+        size_t words = occupiedBuckets.size();
+        size_t wordsPerPartition = (words + BULK_PARTITIONS - 1) / BULK_PARTITIONS;
+        size_t partitions = (words + wordsPerPartition - 1) / wordsPerPartition;
+        size_t bucketsPerPartition = wordsPerPartition * 64;
+        threads = std::min(threads, partitions);
+
+        // Hash all keys
+        std::vector<size_t> hashCodes(pairs.size());
+        std::vector<uint32_t> partitionOf(pairs.size());
+        parallelFor(threads, [&](size_t t) {
+            size_t begin = pairs.size() * t / threads, end = pairs.size() * (t + 1) / threads;
+            for (size_t i = begin; i < end; i++) {
+                hashCodes[i] = hash(pairs[i].first);
+                partitionOf[i] = (uint32_t) (bucketIndex(hashCodes[i]) / bucketsPerPartition);
+            }
+        });
+
+        // Stable counting sort by partition
+        std::vector<size_t> partitionStart(partitions + 1, 0);
+        for (auto partition : partitionOf) partitionStart[partition + 1]++;
+        for (size_t p = 0; p < partitions; p++) partitionStart[p + 1] += partitionStart[p];
+        std::vector<size_t> order(pairs.size());
+        std::vector<size_t> next(partitionStart.begin(), partitionStart.end() - 1);
+        for (size_t i = 0; i < pairs.size(); i++) order[next[partitionOf[i]]++] = i;
+
+        // Insert the partitions, thread t takes partitions t, t + threads, ...
+        std::vector<size_t> inserted(threads, 0);
+        parallelFor(threads, [&](size_t t) {
+            for (size_t p = t; p < partitions; p += threads) {
+                inserted[t] += insertPartition(pairs, hashCodes,
+                                               order.data() + partitionStart[p], order.data() + partitionStart[p + 1]);
+            }
+        });
+
+        size_t insertedTotal = 0;
+        for (auto count : inserted) insertedTotal += count;
+        tableSize += insertedTotal;
+        firstBucketIt = buckets.begin() + nextOccupied(0);
+        return pairs.size() - insertedTotal;
     }
 
     /**
@@ -346,13 +787,10 @@ public:
      * @return whether the key exists
      */
     bool erase(const Key &key) {
-        if(this->contains(key)){
-            Iterator it = this->find(key);
-            this->erase(it);
-
-            return true;
-        }
-        else return false;
+        Iterator it = this->find(key);
+        if (it.endFlag) return false;
+        this->erase(it);
+        return true;
     }
 
     /**
@@ -366,9 +804,20 @@ public:
     Iterator erase(const Iterator &it) {
         if(it.endFlag == true) return it;
 
-        auto temp_it = it.bucketIt->erase_after(it.listItBefore);
+        auto nextListIt = it.bucketIt->erase_after(it.listItBefore);
         this->tableSize--;
-        return Iterator(this, it.bucketIt, temp_it);
+        // The next element is in the same bucket
+        if (nextListIt != it.bucketIt->end()) return Iterator(this, it.bucketIt, it.listItBefore);
+
+        // Otherwise it is the first element of the next non-empty bucket
+        size_t index = (size_t) (it.bucketIt - buckets.begin());
+        size_t nextIndex = nextOccupied(index + 1);
+        if (it.bucketIt->empty()) {
+            markOccupied(index, false);
+            if (it.bucketIt == firstBucketIt) firstBucketIt = buckets.begin() + nextIndex;
+        }
+        if (nextIndex == buckets.size()) return end();
+        return Iterator(this, buckets.begin() + nextIndex, buckets[nextIndex].before_begin());
     }
 
     /**
@@ -381,8 +830,12 @@ public:
      * @return reference of value
      */
     Value &operator[](const Key &key) {
-        if(this->contains(key) == false) this->insert(key,0);
         Iterator it = this->find(key);
+        if (it.endFlag) {
+            // insert may rehash, so find the key again
+            this->insert(it, key, Value());
+            it = this->find(key);
+        }
         return it->second;
     }
 
@@ -392,26 +845,31 @@ public:
      * Instead, findMinimumBucketSize is called to get the correct number
      * firstBucketIt should be updated
      * Do nothing if the bucketSize doesn't change
-     * Time Complexity: O(nk)
+     * Time Complexity: O(n) if CacheHash, otherwise O(nk)
      * @param bucketSize lower bound of the new number of buckets
      */
     void rehash(size_t bucketSize) {
         bucketSize = findMinimumBucketSize(bucketSize);
         if (bucketSize == buckets.size()) return;
-        // Pop all pairs into a vector
-        std::vector<HashNode> v;
-        for(size_t i = 0; i < this->buckets.size(); i++){
-            if(this->buckets[i].empty()) continue;
-            for(auto it = this->buckets[i].begin(); it != this->buckets[i].end(); ++it){
-                HashNode new_node(it->first, it->second);
-                v.push_back(new_node);
-                //this->erase(it->first);
+        HASHTABLE_COUNT(auto start = std::chrono::steady_clock::now());
+        HashTableData newBuckets(bucketSize);
+        primeIndex = HashPrime::lowerBoundIndex(bucketSize);
+        occupiedBuckets.assign((bucketSize + 63) / 64, 0);
+
+        // Move every node to its new bucket, no node is copied or reallocated
+        for (auto &bucket : buckets) {
+            while (!bucket.empty()) {
+                size_t index = bucketIndex(nodeHash(bucket.front()));
+                newBuckets[index].splice_after(newBuckets[index].before_begin(), bucket, bucket.before_begin());
+                markOccupied(index, true);
             }
         }
+        buckets.swap(newBuckets);
+        firstBucketIt = buckets.begin() + nextOccupied(0);
 
-        HashTable<Key, Value> temp_table(bucketSize);
-        for(size_t i = 0; i < v.size(); i++) temp_table.insert(v[i].first, v[i].second);
-        *(this) = temp_table;
+        HASHTABLE_COUNT(counters.rehashCount++);
+        HASHTABLE_COUNT(counters.rehashSeconds += std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count());
     }
 
     /**
@@ -429,6 +887,45 @@ public:
      */
     double loadFactor() const { return (double) tableSize / (double) buckets.size(); }
 
+    /**
+     * Collect the statistics of the hashtable
+     * The bucket statistics are computed on each call, the counters are collected
+     * during lookups and rehashes if HASHTABLE_STATS is defined
+     * Time Complexity: O(n + number of buckets)
+     * @return the statistics
+     */
+    HashTableStats statistics() const {
+        HashTableStats stats;
+#ifdef HASHTABLE_STATS
+        stats.lookups = counters.lookups;
+        stats.hits = counters.hits;
+        stats.misses = counters.misses;
+        stats.probes = counters.probes;
+        stats.rehashCount = counters.rehashCount;
+        stats.rehashSeconds = counters.rehashSeconds;
+#endif
+        stats.size = tableSize;
+        stats.bucketSize = buckets.size();
+        stats.loadFactor = loadFactor();
+        for (const auto &bucket : buckets) {
+            size_t length = (size_t) std::distance(bucket.begin(), bucket.end());
+            if (length >= stats.chainHistogram.size()) stats.chainHistogram.resize(length + 1, 0);
+            stats.chainHistogram[length]++;
+            stats.maxChain = std::max(stats.maxChain, length);
+        }
+        stats.emptyBuckets = stats.chainHistogram.empty() ? 0 : stats.chainHistogram[0];
+        stats.emptyBucketRatio = (double) stats.emptyBuckets / (double) buckets.size();
+        if (stats.emptyBuckets < buckets.size()) {
+            stats.averageChain = (double) tableSize / (double) (buckets.size() - stats.emptyBuckets);
+        }
+        return stats;
+    }
+
+    /**
+     * @return the hash function instance of the hashtable
+     */
+    Hash getHash() const { return hash; }
+
     /**
      * @return the maximum load factor of the hashtable
      */
@@ -449,3 +946,4 @@ public:
 
 };
 
+#endif //VE281P2_HASHTABLE_HPP
@@ -0,0 +1,396 @@
+#ifndef VE281P2_HASHTABLE_SNAPSHOT_HPP
+#define VE281P2_HASHTABLE_SNAPSHOT_HPP
+
+#include "hashtable.hpp"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Snapshot file of a HashTable, which can be opened with mmap and searched in place
+ *
+ * Layout (native byte order, every section is 8-byte aligned):
+ *   SnapshotHeader
+ *   uint64_t bucketStart[bucketCount + 1]    index of the first entry of each bucket
+ *   uint64_t entryHash[entryCount]           full hash value of each entry
+ *   uint64_t entryOffset[entryCount]         byte offset of each entry in the data section
+ *   data                                     encoded key followed by encoded value, for each entry
+ *
+ * Entries are grouped by bucket (bucket = hash % HashPrime::g_a_sizes[primeIndex]), so a lookup
+ * reads one range of bucketStart, compares cached hash values, and decodes only matching keys.
+ * A snapshot can only be searched with the same Hash function that wrote it.
+ */
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t keySize;       // sizeof(Key), or 0 for length-prefixed keys
+    uint64_t valueSize;     // sizeof(Value), or 0 for length-prefixed values
+    uint64_t primeIndex;
+    uint64_t bucketCount;
+    uint64_t entryCount;
+    uint64_t dataSize;
+};
+
+static constexpr char SNAPSHOT_MAGIC[8] = {'V', 'E', '2', '8', '1', 'H', 'T', '\0'};
+static constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+/**
+ * Encode / decode a key or value in the data section of a snapshot
+ * The default codec copies the bytes of a trivially copyable type
+ * @tparam T key or value type
+ */
+template<typename T, typename = void>
+struct SnapshotCodec;
+
+template<typename T>
+struct SnapshotCodec<T, std::enable_if_t<std::is_trivially_copyable<T>::value>> {
+    typedef T View;                                     // type returned by lookups
+    static constexpr uint64_t FIXED_SIZE = sizeof(T);
+
+    static void write(std::ostream &out, const T &item) {
+        out.write(reinterpret_cast<const char *>(&item), sizeof(T));
+    }
+
+    static uint64_t encodedSize(const T &) { return sizeof(T); }
+
+    /**
+     * @param data pointer to the encoded item, advanced to the next item
+     */
+    static View read(const char *&data) {
+        T item;
+        std::memcpy(&item, data, sizeof(T));
+        data += sizeof(T);
+        return item;
+    }
+
+    /**
+     * Skip an encoded item without reading it
+     * @param data pointer to the encoded item, advanced to the next item
+     * @param end end of the data section
+     * @return false if the item does not fit before end
+     */
+    static bool skip(const char *&data, const char *end) {
+        if ((size_t) (end - data) < sizeof(T)) return false;
+        data += sizeof(T);
+        return true;
+    }
+};
+
+// Strings are stored as a uint64_t length followed by the characters, and read as std::string_view
+template<>
+struct SnapshotCodec<std::string> {
+    typedef std::string_view View;
+    static constexpr uint64_t FIXED_SIZE = 0;
+
+    static void write(std::ostream &out, const std::string &item) {
+        uint64_t length = item.size();
+        out.write(reinterpret_cast<const char *>(&length), sizeof(length));
+        out.write(item.data(), (std::streamsize) item.size());
+    }
+
+    static uint64_t encodedSize(const std::string &item) { return sizeof(uint64_t) + item.size(); }
+
+    static View read(const char *&data) {
+        uint64_t length;
+        std::memcpy(&length, data, sizeof(length));
+        View item(data + sizeof(length), length);
+        data += sizeof(length) + length;
+        return item;
+    }
+
+    static bool skip(const char *&data, const char *end) {
+        uint64_t length;
+        if ((size_t) (end - data) < sizeof(length)) return false;
+        std::memcpy(&length, data, sizeof(length));
+        data += sizeof(length);
+        if ((size_t) (end - data) < length) return false;
+        data += length;
+        return true;
+    }
+};
+
+/**
+ * Write all elements of a hashtable into a snapshot file
+ * The snapshot uses the minimum bucket size in HashPrime that is not less than the number of elements,
+ * and the hash function instance of the table, so a MappedHashTable must be given an equal one
+ * Time Complexity: O(nk)
+ * @throw std::runtime_error if the file can not be written
+ * @param table
+ * @param path
+ */
+template<typename Key, typename Value, typename Hash, typename KeyEqual, bool CacheHash>
+void writeSnapshot(const HashTable<Key, Value, Hash, KeyEqual, CacheHash> &table, const std::string &path) {
+    typedef SnapshotCodec<Key> KeyCodec;
+    typedef SnapshotCodec<Value> ValueCodec;
+    typedef typename HashTable<Key, Value, Hash, KeyEqual, CacheHash>::HashNode HashNode;
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.keySize = KeyCodec::FIXED_SIZE;
+    header.valueSize = ValueCodec::FIXED_SIZE;
+    header.primeIndex = HashPrime::lowerBoundIndex(std::max<size_t>(table.size(), 1));
+    header.bucketCount = HashPrime::g_a_sizes[header.primeIndex];
+    header.entryCount = table.size();
+
+    // Counting sort the elements by bucket
+    Hash hash = table.getHash();
+    std::vector<uint64_t> bucketStart(header.bucketCount + 1, 0);
+    std::vector<uint64_t> hashes, buckets;
+    std::vector<const HashNode *> nodes;
+    hashes.reserve(table.size());
+    buckets.reserve(table.size());
+    nodes.reserve(table.size());
+    for (auto it = table.begin(); it != table.end(); ++it) {
+        hashes.push_back(hash(it->first));
+        buckets.push_back(HashPrime::g_a_mods[header.primeIndex](hashes.back()));
+        nodes.push_back(&*it);
+        bucketStart[buckets.back() + 1]++;
+    }
+    if (nodes.size() != header.entryCount) throw std::runtime_error("inconsistent hashtable size!");
+    for (size_t i = 0; i < header.bucketCount; i++) bucketStart[i + 1] += bucketStart[i];
+
+    std::vector<uint64_t> entryHash(header.entryCount), entryOffset(header.entryCount);
+    std::vector<const HashNode *> order(header.entryCount);
+    std::vector<uint64_t> next(bucketStart.begin(), bucketStart.end() - 1);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        uint64_t entry = next[buckets[i]]++;
+        entryHash[entry] = hashes[i];
+        order[entry] = nodes[i];
+    }
+    for (size_t i = 0; i < order.size(); i++) {
+        entryOffset[i] = header.dataSize;
+        header.dataSize += KeyCodec::encodedSize(order[i]->first) + ValueCodec::encodedSize(order[i]->second);
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("can not open snapshot file " + path);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(bucketStart.data()), (std::streamsize) (bucketStart.size() * 8));
+    out.write(reinterpret_cast<const char *>(entryHash.data()), (std::streamsize) (entryHash.size() * 8));
+    out.write(reinterpret_cast<const char *>(entryOffset.data()), (std::streamsize) (entryOffset.size() * 8));
+    for (auto node : order) {
+        KeyCodec::write(out, node->first);
+        ValueCodec::write(out, node->second);
+    }
+    if (!out.flush()) throw std::runtime_error("can not write snapshot file " + path);
+}
+
+/**
+ * A read-only hashtable that searches a snapshot file in place
+ * The file is mapped with mmap, nothing is deserialized when opening,
+ * and processes opening the same snapshot share the pages in the page cache
+ * @tparam Key          key type of the written HashTable
+ * @tparam Value        value type of the written HashTable
+ * @tparam Hash         the same hash function as the one used to write the snapshot
+ * @tparam KeyEqual     function object, compare a decoded key with a searched key
+ */
+template<
+        typename Key, typename Value,
+        typename Hash = std::hash<Key>,
+        typename KeyEqual = std::equal_to<>
+>
+class MappedHashTable {
+public:
+    typedef typename SnapshotCodec<Key>::View KeyView;
+    typedef typename SnapshotCodec<Value>::View ValueView;
+
+protected:
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+    const SnapshotHeader *header = nullptr;
+    const uint64_t *bucketStart = nullptr;
+    const uint64_t *entryHash = nullptr;
+    const uint64_t *entryOffset = nullptr;
+    const char *data = nullptr;
+    Hash hash;
+    KeyEqual keyEqual;
+
+    void release() {
+        if (mapping) munmap(mapping, mappingSize);
+        mapping = nullptr;
+    }
+
+    /**
+     * Check the header, and that the tables and the data section it describes exactly fill the mapping
+     * The sizes in the header are checked with divisions, so that a corrupt header can not overflow
+     * The contents of the tables are not read, so that opening a snapshot touches only its first page
+     * Time Complexity: O(1)
+     * @return whether the header is valid for a snapshot of this type
+     */
+    bool validHeader() const {
+        if (std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != SNAPSHOT_VERSION ||
+            header->keySize != SnapshotCodec<Key>::FIXED_SIZE ||
+            header->valueSize != SnapshotCodec<Value>::FIXED_SIZE ||
+            header->primeIndex >= HashPrime::num_distinct_sizes_64_bit ||
+            header->bucketCount != HashPrime::g_a_sizes[header->primeIndex]) {
+            return false;
+        }
+        size_t words = (mappingSize - sizeof(SnapshotHeader)) / sizeof(uint64_t);
+        if (header->bucketCount >= words || header->entryCount > (words - header->bucketCount - 1) / 2) return false;
+        size_t tableBytes = (header->bucketCount + 1 + 2 * header->entryCount) * sizeof(uint64_t);
+        return header->dataSize == mappingSize - sizeof(SnapshotHeader) - tableBytes;
+    }
+
+    /**
+     * @throw std::runtime_error
+     */
+    [[noreturn]] static void corrupt() {
+        throw std::runtime_error("corrupt snapshot file");
+    }
+
+    /**
+     * Check an entry before decoding it, so that a corrupt offset or length never reads outside the mapping
+     * Time Complexity: O(1)
+     * @throw std::runtime_error if the entry does not fit in the data section
+     * @param index
+     * @return pointer to the encoded key of the entry
+     */
+    const char *entryAt(uint64_t index) const {
+        if (entryOffset[index] > header->dataSize) corrupt();
+        const char *entry = data + entryOffset[index];
+        const char *next = entry;
+        if (!SnapshotCodec<Key>::skip(next, data + header->dataSize) ||
+            !SnapshotCodec<Value>::skip(next, data + header->dataSize)) {
+            corrupt();
+        }
+        return entry;
+    }
+
+public:
+    /**
+     * Map a snapshot file
+     * Only the header is checked, the buckets and entries are checked when a lookup uses them
+     * (call verify to check the whole file at once)
+     * Time Complexity: O(1)
+     * @throw std::runtime_error if the file can not be mapped or its header is not valid for this type
+     * @param path
+     * @param hash the hash function instance of the written HashTable
+     */
+    explicit MappedHashTable(const std::string &path, const Hash &hash = Hash()) : hash(hash) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("can not open snapshot file " + path);
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+            close(fd);
+            throw std::runtime_error("invalid snapshot file " + path);
+        }
+        mappingSize = (size_t) st.st_size;
+        mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            mapping = nullptr;
+            throw std::runtime_error("can not map snapshot file " + path);
+        }
+
+        header = static_cast<const SnapshotHeader *>(mapping);
+        if (!validHeader()) {
+            release();
+            throw std::runtime_error("invalid snapshot file " + path);
+        }
+        bucketStart = reinterpret_cast<const uint64_t *>(header + 1);
+        entryHash = bucketStart + header->bucketCount + 1;
+        entryOffset = entryHash + header->entryCount;
+        data = reinterpret_cast<const char *>(entryOffset + header->entryCount);
+    }
+
+    MappedHashTable(const MappedHashTable &) = delete;
+
+    MappedHashTable &operator=(const MappedHashTable &) = delete;
+
+    ~MappedHashTable() { release(); }
+
+    /**
+     * Find the value in the snapshot by key
+     * The bucket and the compared entries are bounds-checked first
+     * Time Complexity: Amortized O(k)
+     * @throw std::runtime_error if the bucket or an entry of it is corrupt
+     * @param key any type that Hash accepts and KeyEqual compares with KeyView
+     * @return the value, or std::nullopt if the key doesn't exist
+     */
+    template<typename K>
+    std::optional<ValueView> find(const K &key) const {
+        uint64_t hashCode = hash(key);
+        size_t bucket = HashPrime::g_a_mods[header->primeIndex](hashCode);
+        uint64_t first = bucketStart[bucket], last = bucketStart[bucket + 1];
+        if (first > last || last > header->entryCount) corrupt();
+        for (uint64_t i = first; i < last; i++) {
+            if (entryHash[i] != hashCode) continue;
+            const char *entry = entryAt(i);
+            if (keyEqual(SnapshotCodec<Key>::read(entry), key)) return SnapshotCodec<Value>::read(entry);
+        }
+        return std::nullopt;
+    }
+
+    /**
+     * Time Complexity: Amortized O(k)
+     * @param key
+     * @return whether the key exists in the snapshot
+     */
+    template<typename K>
+    bool contains(const K &key) const {
+        return find(key).has_value();
+    }
+
+    /**
+     * Visit all elements in the snapshot
+     * Each entry is bounds-checked before it is decoded
+     * Time Complexity: O(nk)
+     * @throw std::runtime_error if an entry is corrupt
+     * @param visit function object, called with (KeyView, ValueView) of each element
+     */
+    template<typename Visitor>
+    void forEach(Visitor visit) const {
+        for (uint64_t i = 0; i < header->entryCount; i++) {
+            const char *entry = entryAt(i);
+            KeyView key = SnapshotCodec<Key>::read(entry);
+            visit(key, SnapshotCodec<Value>::read(entry));
+        }
+    }
+
+    /**
+     * Check the whole snapshot at once: the buckets are consecutive ranges of the entries,
+     * and the entries are consecutive in the data section, as written by writeSnapshot
+     * Lookups check what they use anyway, this is for callers that want to reject a corrupt file early
+     * Time Complexity: O(n + number of buckets), reads every page of the file
+     * @return whether the snapshot is intact
+     */
+    bool verify() const {
+        if (bucketStart[0] != 0 || bucketStart[header->bucketCount] != header->entryCount) return false;
+        for (uint64_t i = 0; i < header->bucketCount; i++) {
+            if (bucketStart[i] > bucketStart[i + 1]) return false;
+        }
+        const char *end = data + header->dataSize;
+        const char *entry = data;
+        for (uint64_t i = 0; i < header->entryCount; i++) {
+            if (entryOffset[i] != (uint64_t) (entry - data) ||
+                !SnapshotCodec<Key>::skip(entry, end) || !SnapshotCodec<Value>::skip(entry, end)) {
+                return false;
+            }
+        }
+        return entry == end;
+    }
+
+    /**
+     * @return the number of elements in the snapshot
+     */
+    size_t size() const { return header->entryCount; }
+
+    /**
+     * @return the number of buckets in the snapshot
+     */
+    size_t bucketSize() const { return header->bucketCount; }
+};
+
+#endif //VE281P2_HASHTABLE_SNAPSHOT_HPP
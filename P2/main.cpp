@@ -1,46 +1,237 @@
+// Microbenchmark of HashTable against std::unordered_map
+// The results of every table are checked against std::unordered_map
+// Build with: g++ -std=c++17 -O2 -DHASHTABLE_STATS main.cpp -o main
+// Usage: ./main [number of elements] [number of lookups]
 #include "hashtable.hpp"
+#include "hashtable_snapshot.hpp"
+#include "flat_hashtable.hpp"
+#include "cuckoo_hashtable.hpp"
+#include <cstdio>
 #include <chrono>
+#include <iomanip>
+#include <random>
+#include <unordered_map>
 using namespace std;
 
-int main(int argc, char const *argv[])
-{
-    
-    size_t bucketNum = 10;
-    HashTable<int, char> H1(bucketNum);
-    cout << H1.bucketSize() << endl;
-    
-    int key = 20;
-    char value = 'a';
-    if(H1.insert(20, 'a')) cout << "insert successfully!" << endl;
-    cout << H1[20] << endl;
-    cout << H1[10] << endl;
-    //for(auto it = H1.begin(); it != H1.end(); ++it) cout << it->first << " " << it->second << endl;
-    if(H1.insert(30, 'b')) cout << "insert successfully!" << endl;
-    for(auto it = H1.begin(); it != H1.end(); ++it) cout << it->first << " " << it->second << endl;
-    if(H1.insert(40, 'c')) cout << "insert successfully!" << endl;
-    if(H1.insert(50, 'd')) cout << "insert successfully!" << endl;
-    cout << H1.loadFactor() << endl;
-    if(H1.insert(60, 'e')) cout << "insert successfully!" << endl;
-    cout << H1.bucketSize() << endl;
-    // HashTable<int, char> H2(H1);
-    // if(H2.insert(40, 'c')) cout << "insert successfully!" << endl;
-    // for(auto it = H2.begin(); it != H2.end(); ++it) cout << it->first << " " << it->second << endl;
-    
-    // HashTable<int, char> H3;
-    // cout << H3.bucketSize() << endl;
-    // if(H3.insert(21, 'b')) cout << "insert successfully!" << endl;
-    // H3 = H2;
-    // cout << H3.bucketSize() << endl;
-    //for(auto it = H3.begin(); it != H3.end(); ++it) cout << it->first << " " << it->second << endl;
-
-    
- 
-    // if(H1.erase(20)){
-    // }
-
-    // if(H1.erase(10)){
-    // }
-    return 0;
+typedef unsigned long long Key;
+
+// Draw ranks in [0, n) with probability proportional to 1 / (rank + 1)^s
+class ZipfGenerator {
+    vector<double> cdf;
+
+public:
+    ZipfGenerator(size_t n, double s) : cdf(n) {
+        double sum = 0;
+        for (size_t i = 0; i < n; i++) {
+            sum += 1.0 / pow((double) (i + 1), s);
+            cdf[i] = sum;
+        }
+        for (auto &p : cdf) p /= sum;
+    }
+
+    template<typename Engine>
+    size_t operator()(Engine &engine) {
+        double p = uniform_real_distribution<double>(0, 1)(engine);
+        return (size_t) (lower_bound(cdf.begin(), cdf.end(), p) - cdf.begin());
+    }
+};
+
+struct Workload {
+    string name;
+    vector<Key> keys;       // keys to insert
+    vector<Key> lookups;    // keys to look up, all of them are inserted
+    vector<Key> misses;     // keys to look up, none of them is inserted
+};
+
+template<typename Function>
+double nanosecondsPerOp(size_t ops, Function function) {
+    auto start = chrono::steady_clock::now();
+    function();
+    auto end = chrono::steady_clock::now();
+    return chrono::duration<double, nano>(end - start).count() / (double) max<size_t>(ops, 1);
+}
+
+// Prevent the compiler from removing the lookups
+volatile size_t sink;
+
+/**
+ * Time another hashtable on a workload and check its results against std::unordered_map,
+ * after erasing every other key (and with the largest key, which some tables reserve)
+ * @tparam TableKey key type of Table, the keys of the workload are converted to it
+ */
+template<typename Table, typename TableKey = Key>
+void runTable(const string &name, const Workload &workload) {
+    size_t found;
+    Table table;
+    unordered_map<TableKey, Key> map;
+    for (auto key : workload.keys) map[(TableKey) key] = key;
+
+    double tableInsert = nanosecondsPerOp(workload.keys.size(), [&] {
+        for (auto key : workload.keys) table.insert((TableKey) key, key);
+    });
+    double tableFind = nanosecondsPerOp(workload.lookups.size(), [&] {
+        found = 0;
+        for (auto key : workload.lookups) found += table.contains((TableKey) key);
+        sink = found;
+    });
+    double tableMiss = nanosecondsPerOp(workload.misses.size(), [&] {
+        found = 0;
+        for (auto key : workload.misses) found += table.contains((TableKey) key);
+        sink = found;
+    });
+    vector<TableKey> erased;
+    for (size_t i = 0; i < workload.keys.size(); i += 2) erased.push_back((TableKey) workload.keys[i]);
+    double tableErase = nanosecondsPerOp(erased.size(), [&] {
+        for (auto key : erased) table.erase(key);
+    });
+    for (auto key : erased) map.erase(key);
+    table.insert(numeric_limits<TableKey>::max(), 1);
+    map[numeric_limits<TableKey>::max()] = 1;
+
+    bool same = table.size() == map.size();
+    for (auto key : workload.keys) {
+        auto it = table.find((TableKey) key);
+        auto mapIt = map.find((TableKey) key);
+        same = same && (it == table.end()) == (mapIt == map.end()) && (mapIt == map.end() || (*it).second == mapIt->second);
+    }
+    for (auto key : workload.misses) same = same && table.contains((TableKey) key) == (map.count((TableKey) key) > 0);
+    size_t iterated = 0;
+    for (auto it = table.begin(); it != table.end(); ++it) iterated++;
+    same = same && iterated == map.size();
+
+    cout << left << setw(20) << name << right << "insert " << tableInsert << ", find (hit) " << tableFind
+         << ", find (miss) " << tableMiss << ", erase " << tableErase << " (ns/op)" << endl;
+    if (!same) cout << "results differ!" << endl;
 }
 
+void runWorkload(const Workload &workload) {
+    size_t found;
+    HashTable<Key, Key> table;
+    unordered_map<Key, Key> map;
 
+    double tableInsert = nanosecondsPerOp(workload.keys.size(), [&] {
+        for (auto key : workload.keys) table.insert(key, key);
+    });
+    double mapInsert = nanosecondsPerOp(workload.keys.size(), [&] {
+        for (auto key : workload.keys) map.emplace(key, key);
+    });
+    double tableFind = nanosecondsPerOp(workload.lookups.size(), [&] {
+        found = 0;
+        for (auto key : workload.lookups) found += table.contains(key);
+        sink = found;
+    });
+    double mapFind = nanosecondsPerOp(workload.lookups.size(), [&] {
+        found = 0;
+        for (auto key : workload.lookups) found += map.count(key);
+        sink = found;
+    });
+    double tableBatch = nanosecondsPerOp(workload.lookups.size(), [&] {
+        auto result = table.containsMany(workload.lookups);
+        sink = (size_t) count(result.begin(), result.end(), true);
+    });
+    double tableMiss = nanosecondsPerOp(workload.misses.size(), [&] {
+        found = 0;
+        for (auto key : workload.misses) found += table.contains(key);
+        sink = found;
+    });
+    double mapMiss = nanosecondsPerOp(workload.misses.size(), [&] {
+        found = 0;
+        for (auto key : workload.misses) found += map.count(key);
+        sink = found;
+    });
+
+    // Before the checks below, which also count as lookups
+    HashTableStats stats = table.statistics();
+
+    // Write a snapshot of the table and search the mapped file
+    string path = "main_hashtable_snapshot.bin";
+    double snapshotWrite = nanosecondsPerOp(workload.keys.size(), [&] { writeSnapshot(table, path); });
+    MappedHashTable<Key, Key> *snapshot = nullptr;
+    double snapshotMap = nanosecondsPerOp(1, [&] { snapshot = new MappedHashTable<Key, Key>(path); });
+    double snapshotFind = nanosecondsPerOp(workload.lookups.size(), [&] {
+        found = 0;
+        for (auto key : workload.lookups) found += snapshot->contains(key);
+        sink = found;
+    });
+
+    // Check every lookup against unordered_map
+    bool same = table.size() == map.size() && snapshot->size() == map.size();
+    for (auto key : workload.lookups) {
+        auto it = table.find(key);
+        auto value = snapshot->find(key);
+        same = same && it != table.end() && it->second == map.at(key) && value && *value == map.at(key);
+    }
+    for (auto key : workload.misses) {
+        same = same && table.find(key) == table.end() && !snapshot->contains(key) && !map.count(key);
+    }
+    delete snapshot;
+    remove(path.c_str());
+
+    cout << "== " << workload.name << " (" << workload.keys.size() << " keys, "
+         << workload.lookups.size() << " lookups)" << endl;
+    cout << "                 HashTable  unordered_map   (ns/op)" << endl;
+    cout << "insert        " << setw(12) << tableInsert << setw(15) << mapInsert << endl;
+    cout << "find (hit)    " << setw(12) << tableFind << setw(15) << mapFind << endl;
+    cout << "findMany (hit)" << setw(12) << tableBatch << setw(15) << "-" << endl;
+    cout << "find (miss)   " << setw(12) << tableMiss << setw(15) << mapMiss << endl;
+    cout << "snapshot write" << setw(12) << snapshotWrite << setw(15) << "-" << endl;
+    cout << "snapshot map (ms)" << setw(9) << snapshotMap / 1e6 << setw(15) << "-" << endl;
+    cout << "snapshot find " << setw(12) << snapshotFind << setw(15) << "-" << endl;
+    if (!same) cout << "results differ!" << endl;
+
+    cout << "buckets " << stats.bucketSize << ", load factor " << stats.loadFactor
+         << ", empty buckets " << stats.emptyBucketRatio * 100 << "%, max chain " << stats.maxChain
+         << ", average chain " << stats.averageChain << endl;
+    cout << "chain histogram:";
+    for (size_t i = 0; i < stats.chainHistogram.size() && i <= 8; i++) cout << " [" << i << "]=" << stats.chainHistogram[i];
+    if (stats.chainHistogram.size() > 9) cout << " ...";
+    cout << endl;
+#ifdef HASHTABLE_STATS
+    cout << "lookups " << stats.lookups << ", hits " << stats.hits << ", misses " << stats.misses
+         << ", probes per lookup " << (double) stats.probes / (double) max<size_t>(stats.lookups, 1)
+         << ", rehashes " << stats.rehashCount << " in " << stats.rehashSeconds * 1000 << " ms" << endl;
+#endif
+    runTable<FlatHashTable<Key, Key>>("FlatHashTable", workload);
+    runTable<CompactHashTable<uint32_t, Key>, uint32_t>("CompactHashTable", workload);
+    runTable<CuckooHashTable<Key, Key>>("CuckooHashTable", workload);
+    runTable<CuckooHashTable<uint32_t, Key>, uint32_t>("CuckooHashTable 32", workload);
+    cout << endl;
+}
+
+int main(int argc, char const *argv[]) {
+    size_t n = argc > 1 ? (size_t) atoll(argv[1]) : 1000000;
+    size_t lookupNum = argc > 2 ? (size_t) atoll(argv[2]) : n;
+    mt19937_64 engine(281);
+    cout << fixed << setprecision(1);
+
+    // Uniform: random keys, random lookups
+    Workload uniform;
+    uniform.name = "uniform";
+    for (size_t i = 0; i < n; i++) uniform.keys.push_back(engine());
+    for (size_t i = 0; i < lookupNum && n > 0; i++) uniform.lookups.push_back(uniform.keys[engine() % n]);
+    for (size_t i = 0; i < lookupNum; i++) uniform.misses.push_back(engine() | 1ull << 63);
+    for (auto &key : uniform.keys) key &= ~(1ull << 63);
+    for (auto &key : uniform.lookups) key &= ~(1ull << 63);
+    runWorkload(uniform);
+
+    // Zipf: the same keys, lookups skewed towards a few hot keys
+    Workload zipf;
+    zipf.name = "zipf s=0.99";
+    zipf.keys = uniform.keys;
+    zipf.misses = uniform.misses;
+    ZipfGenerator generator(n, 0.99);
+    for (size_t i = 0; i < lookupNum && n > 0; i++) zipf.lookups.push_back(zipf.keys[generator(engine)]);
+    runWorkload(zipf);
+
+    // Adversarial: std::hash of integers is the identity, so multiples of the final bucket
+    // number of HashTable all fall into bucket 0 (quadratic, so fewer keys are used)
+    Workload adversarial;
+    adversarial.name = "adversarial";
+    size_t m = min<size_t>(n, 20000);
+    size_t prime = HashPrime::g_a_sizes[HashPrime::lowerBoundIndex(2 * m + 1)];
+    for (size_t i = 0; i < m; i++) adversarial.keys.push_back(i * prime);
+    for (size_t i = 0; i < min(lookupNum, m) && m > 0; i++) adversarial.lookups.push_back(adversarial.keys[engine() % m]);
+    for (size_t i = 0; i < min(lookupNum, m); i++) adversarial.misses.push_back((m + i) * prime);
+    runWorkload(adversarial);
+    return 0;
+}
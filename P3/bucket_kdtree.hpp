@@ -0,0 +1,600 @@
+#ifndef VE281P3_BUCKET_KDTREE_HPP
+#define VE281P3_BUCKET_KDTREE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <random>
+#include <tuple>
+#include <unordered_set>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Scan the points of a leaf, stored as one array per dimension
+ * float and double are scanned 8 / 4 points at a time with AVX2 if available,
+ * other types (and the points left over) one by one
+ * @tparam Scalar coordinate type
+ * @tparam Dims number of dimensions
+ */
+template<typename Scalar, size_t Dims>
+struct LeafScan {
+    typedef std::array<const Scalar *, Dims> Columns;
+    typedef std::array<Scalar, Dims> Point;
+    // Distances are computed in float for float coordinates, in double otherwise
+    typedef std::conditional_t<std::is_same<Scalar, float>::value, float, double> Distance;
+
+    /**
+     * Squared L2 distances from query to the points [0, count)
+     * Time Complexity: O(k count)
+     * @param columns
+     * @param query
+     * @param count
+     * @param out
+     */
+    static void distances(const Columns &columns, const Point &query, size_t count, Distance *out) {
+        size_t i = 0;
+#if defined(__AVX2__)
+        if constexpr (std::is_same<Scalar, float>::value) {
+            for (; i + 8 <= count; i += 8) {
+                __m256 total = _mm256_setzero_ps();
+                for (size_t d = 0; d < Dims; d++) {
+                    __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(columns[d] + i), _mm256_set1_ps(query[d]));
+                    total = _mm256_add_ps(total, _mm256_mul_ps(diff, diff));
+                }
+                _mm256_storeu_ps(out + i, total);
+            }
+        } else if constexpr (std::is_same<Scalar, double>::value) {
+            for (; i + 4 <= count; i += 4) {
+                __m256d total = _mm256_setzero_pd();
+                for (size_t d = 0; d < Dims; d++) {
+                    __m256d diff = _mm256_sub_pd(_mm256_loadu_pd(columns[d] + i), _mm256_set1_pd(query[d]));
+                    total = _mm256_add_pd(total, _mm256_mul_pd(diff, diff));
+                }
+                _mm256_storeu_pd(out + i, total);
+            }
+        }
+#endif
+        for (; i < count; i++) {
+            Distance total = 0;
+            for (size_t d = 0; d < Dims; d++) {
+                Distance diff = Distance(columns[d][i]) - Distance(query[d]);
+                total += diff * diff;
+            }
+            out[i] = total;
+        }
+    }
+
+    /**
+     * Call visit(i) for each point i in [0, count) inside the box [lo, hi]
+     * Time Complexity: O(k count)
+     * @param columns
+     * @param lo
+     * @param hi
+     * @param count
+     * @param visit
+     */
+    template<typename Visitor>
+    static void inside(const Columns &columns, const Point &lo, const Point &hi, size_t count, Visitor &visit) {
+        size_t i = 0;
+#if defined(__AVX2__)
+        if constexpr (std::is_same<Scalar, float>::value) {
+            for (; i + 8 <= count; i += 8) {
+                __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+                for (size_t d = 0; d < Dims; d++) {
+                    __m256 x = _mm256_loadu_ps(columns[d] + i);
+                    mask = _mm256_and_ps(mask, _mm256_cmp_ps(x, _mm256_set1_ps(lo[d]), _CMP_GE_OQ));
+                    mask = _mm256_and_ps(mask, _mm256_cmp_ps(x, _mm256_set1_ps(hi[d]), _CMP_LE_OQ));
+                }
+                for (auto bits = (uint32_t) _mm256_movemask_ps(mask); bits; bits &= bits - 1) {
+                    visit(i + (size_t) __builtin_ctz(bits));
+                }
+            }
+        } else if constexpr (std::is_same<Scalar, double>::value) {
+            for (; i + 4 <= count; i += 4) {
+                __m256d mask = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+                for (size_t d = 0; d < Dims; d++) {
+                    __m256d x = _mm256_loadu_pd(columns[d] + i);
+                    mask = _mm256_and_pd(mask, _mm256_cmp_pd(x, _mm256_set1_pd(lo[d]), _CMP_GE_OQ));
+                    mask = _mm256_and_pd(mask, _mm256_cmp_pd(x, _mm256_set1_pd(hi[d]), _CMP_LE_OQ));
+                }
+                for (auto bits = (uint32_t) _mm256_movemask_pd(mask); bits; bits &= bits - 1) {
+                    visit(i + (size_t) __builtin_ctz(bits));
+                }
+            }
+        }
+#endif
+        for (; i < count; i++) {
+            bool in = true;
+            for (size_t d = 0; d < Dims && in; d++) in = !(columns[d][i] < lo[d]) && !(hi[d] < columns[d][i]);
+            if (in) visit(i);
+        }
+    }
+};
+
+/**
+ * A read-only KDTree whose leaves hold up to LeafSize points
+ * The points are reordered so that every subtree is a contiguous range, and stored as one array
+ * per dimension, so a leaf is scanned with LeafScan instead of branching on every point.
+ * Each node keeps the bounding box of its points: queries skip the nodes outside the box
+ * (or farther than the current neighbors), and report the nodes fully inside a range without
+ * checking their points.
+ * An inner node splits its points at the median of the dimension with the largest spread
+ * (or of a random one of the RANDOM_SPLIT_DIMS largest, for the trees of BucketKDForest).
+ * Points are referred to by their indices.
+ * The time complexity of functions are based on n and k
+ * n is the size of the tree
+ * k is the number of dimensions
+ * @tparam Scalar   coordinate type, arithmetic
+ * @tparam Dims     k (number of dimensions)
+ * @tparam Value    value type
+ * @tparam LeafSize maximum number of points in a leaf
+ */
+template<typename Scalar, size_t Dims, typename Value, size_t LeafSize>
+class BucketKDForest;
+
+template<typename Scalar, size_t Dims, typename Value, size_t LeafSize = 32>
+class BucketKDTree {
+public:
+    typedef std::array<Scalar, Dims> Key;
+    static_assert(std::is_arithmetic<Scalar>::value, "BucketKDTree needs arithmetic coordinates");
+    static_assert(Dims > 0, "Can not construct BucketKDTree with zero dimension");
+    static_assert(LeafSize > 0, "Leaves must hold at least one point");
+
+protected:
+    typedef LeafScan<Scalar, Dims> Scan;
+    typedef typename Scan::Distance Distance;
+    typedef std::priority_queue<std::pair<double, size_t>> NeighborHeap;
+    // Min-heap of (distance to the box, tree, node) for best-bin-first search, the tree is used by BucketKDForest
+    typedef std::tuple<double, size_t, size_t> Branch;
+    typedef std::priority_queue<Branch, std::vector<Branch>, std::greater<>> BranchHeap;
+
+    static constexpr size_t RANDOM_SPLIT_DIMS = 5;
+
+    template<typename, size_t, typename, size_t>
+    friend class BucketKDForest;
+
+    struct Node {
+        size_t begin;           // range of the points in the subtree
+        size_t end;
+        size_t right = 0;       // index of the right child, the left child is the next node; 0 for a leaf
+        Key low;                // bounding box of the points
+        Key high;
+    };
+
+    std::array<std::vector<Scalar>, Dims> coordinates;  // coordinates[d][i] is dimension d of point i
+    std::vector<Value> values;
+    std::vector<Node> nodes;                            // in preorder
+
+    typename Scan::Columns columns(const Node &node) const {
+        typename Scan::Columns result;
+        for (size_t d = 0; d < Dims; d++) result[d] = coordinates[d].data() + node.begin;
+        return result;
+    }
+
+    /**
+     * Build the subtree of points[begin, end)
+     * Time Complexity: O(kn log n)
+     * @param engine if not nullptr, split on a random one of the RANDOM_SPLIT_DIMS dimensions with the largest spread
+     * @return index of the node
+     */
+    size_t build(std::vector<std::pair<Key, Value>> &points, size_t begin, size_t end, std::mt19937_64 *engine) {
+        size_t index = nodes.size();
+        nodes.emplace_back();
+        Node node;
+        node.begin = begin;
+        node.end = end;
+        node.low = node.high = points[begin].first;
+        for (size_t i = begin + 1; i < end; i++) {
+            for (size_t d = 0; d < Dims; d++) {
+                node.low[d] = std::min(node.low[d], points[i].first[d]);
+                node.high[d] = std::max(node.high[d], points[i].first[d]);
+            }
+        }
+        if (end - begin > LeafSize) {
+            auto spread = [&](size_t d) { return double(node.high[d]) - double(node.low[d]); };
+            size_t dim = 0;
+            if (engine) {
+                std::array<size_t, Dims> dims;
+                for (size_t d = 0; d < Dims; d++) dims[d] = d;
+                size_t candidates = std::min(Dims, RANDOM_SPLIT_DIMS);
+                std::partial_sort(dims.begin(), dims.begin() + candidates, dims.end(),
+                                  [&](size_t a, size_t b) { return spread(a) > spread(b); });
+                dim = dims[(*engine)() % candidates];
+            } else {
+                for (size_t d = 1; d < Dims; d++) {
+                    if (spread(d) > spread(dim)) dim = d;
+                }
+            }
+            size_t mid = begin + (end - begin) / 2;
+            std::nth_element(points.begin() + begin, points.begin() + mid, points.begin() + end,
+                             [dim](const std::pair<Key, Value> &a, const std::pair<Key, Value> &b) {
+                                 return a.first[dim] < b.first[dim];
+                             });
+            build(points, begin, mid, engine);
+            node.right = build(points, mid, end, engine);
+        }
+        nodes[index] = node;
+        return index;
+    }
+
+    /**
+     * @return squared L2 distance from key to the bounding box of node
+     */
+    static double boxDistance(const Node &node, const Key &key) {
+        double total = 0;
+        for (size_t d = 0; d < Dims; d++) {
+            double diff = 0;
+            if (key[d] < node.low[d]) diff = double(node.low[d]) - double(key[d]);
+            else if (node.high[d] < key[d]) diff = double(key[d]) - double(node.high[d]);
+            total += diff * diff;
+        }
+        return total;
+    }
+
+    static bool intersects(const Node &node, const Key &lo, const Key &hi) {
+        for (size_t d = 0; d < Dims; d++) {
+            if (node.high[d] < lo[d] || hi[d] < node.low[d]) return false;
+        }
+        return true;
+    }
+
+    static bool contains(const Node &node, const Key &lo, const Key &hi) {
+        for (size_t d = 0; d < Dims; d++) {
+            if (node.low[d] < lo[d] || hi[d] < node.high[d]) return false;
+        }
+        return true;
+    }
+
+    void nearest(size_t index, const Key &key, size_t count, NeighborHeap &heap) const {
+        const Node &node = nodes[index];
+        if (!node.right) {
+            Distance distances[LeafSize];
+            Scan::distances(columns(node), key, node.end - node.begin, distances);
+            for (size_t i = 0; i < node.end - node.begin; i++) {
+                if (heap.size() < count) heap.emplace(distances[i], node.begin + i);
+                else if (distances[i] < heap.top().first) {
+                    heap.pop();
+                    heap.emplace(distances[i], node.begin + i);
+                }
+            }
+            return;
+        }
+        size_t nearChild = index + 1, farChild = node.right;
+        double nearDistance = boxDistance(nodes[nearChild], key), farDistance = boxDistance(nodes[farChild], key);
+        if (farDistance < nearDistance) {
+            std::swap(nearChild, farChild);
+            std::swap(nearDistance, farDistance);
+        }
+        if (heap.size() < count || nearDistance < heap.top().first) nearest(nearChild, key, count, heap);
+        if (heap.size() < count || farDistance < heap.top().first) nearest(farChild, key, count, heap);
+    }
+
+    /**
+     * One step of best-bin-first search: go down from a node to a leaf through the nearer children,
+     * push the farther ones closer than limit into branches, and offer the points of the leaf
+     * Time Complexity: O(k log n + k LeafSize + log n log b), b is the size of branches
+     * @param index
+     * @param key
+     * @param limit nodes not closer than limit are skipped
+     * @param tree tree of the pushed branches
+     * @param branches
+     * @param offer function object, called with the squared distance and the index of each point of the leaf
+     */
+    template<typename Offer>
+    void searchLeaf(size_t index, const Key &key, double limit, size_t tree, BranchHeap &branches, Offer &offer) const {
+        while (nodes[index].right) {
+            size_t nearChild = index + 1, farChild = nodes[index].right;
+            double nearDistance = boxDistance(nodes[nearChild], key), farDistance = boxDistance(nodes[farChild], key);
+            if (farDistance < nearDistance) {
+                std::swap(nearChild, farChild);
+                std::swap(nearDistance, farDistance);
+            }
+            if (nearDistance >= limit) return;
+            if (farDistance < limit) branches.emplace(farDistance, tree, farChild);
+            index = nearChild;
+        }
+        const Node &leaf = nodes[index];
+        Distance distances[LeafSize];
+        Scan::distances(columns(leaf), key, leaf.end - leaf.begin, distances);
+        for (size_t i = 0; i < leaf.end - leaf.begin; i++) offer(double(distances[i]), leaf.begin + i);
+    }
+
+    /**
+     * Move the candidates from the heap to indices, from the nearest to the farthest
+     */
+    static std::vector<size_t> sortedNeighbors(NeighborHeap &heap) {
+        std::vector<size_t> result(heap.size());
+        for (size_t i = result.size(); i > 0; i--) {
+            result[i - 1] = heap.top().second;
+            heap.pop();
+        }
+        return result;
+    }
+
+    template<typename Visitor>
+    void range(size_t index, const Key &lo, const Key &hi, Visitor &visit) const {
+        const Node &node = nodes[index];
+        if (!intersects(node, lo, hi)) return;
+        if (contains(node, lo, hi)) {
+            for (size_t i = node.begin; i < node.end; i++) visit(i);
+        } else if (!node.right) {
+            auto visitLeaf = [&](size_t i) { visit(node.begin + i); };
+            Scan::inside(columns(node), lo, hi, node.end - node.begin, visitLeaf);
+        } else {
+            range(index + 1, lo, hi, visit);
+            range(node.right, lo, hi, visit);
+        }
+    }
+
+    size_t rangeCount(size_t index, const Key &lo, const Key &hi) const {
+        const Node &node = nodes[index];
+        if (!intersects(node, lo, hi)) return 0;
+        if (contains(node, lo, hi)) return node.end - node.begin;
+        if (node.right) return rangeCount(index + 1, lo, hi) + rangeCount(node.right, lo, hi);
+        size_t count = 0;
+        auto visitLeaf = [&](size_t) { count++; };
+        Scan::inside(columns(node), lo, hi, node.end - node.begin, visitLeaf);
+        return count;
+    }
+
+    /**
+     * Build the tree from v, which is reordered
+     * Time Complexity: O(kn log n)
+     * @param v
+     * @param engine nullptr for the deterministic splits, see build
+     */
+    void construct(std::vector<std::pair<Key, Value>> &v, std::mt19937_64 *engine) {
+        if (v.empty()) return;
+        nodes.reserve(2 * (v.size() / (LeafSize / 2 + 1)) + 1);
+        build(v, 0, v.size(), engine);
+        for (size_t d = 0; d < Dims; d++) {
+            coordinates[d].resize(v.size());
+            for (size_t i = 0; i < v.size(); i++) coordinates[d][i] = v[i].first[d];
+        }
+        values.reserve(v.size());
+        for (auto &item : v) values.push_back(std::move(item.second));
+    }
+
+public:
+    BucketKDTree() = default;
+
+    /**
+     * Build the tree, duplicated keys are kept as separate points
+     * Time complexity: O(kn log n)
+     * @param v we pass by value here because v need to be modified
+     */
+    explicit BucketKDTree(std::vector<std::pair<Key, Value>> v) {
+        construct(v, nullptr);
+    }
+
+    /**
+     * Build a randomized tree, every inner node splits on a random one of the
+     * RANDOM_SPLIT_DIMS dimensions with the largest spread
+     * Time complexity: O(kn log n)
+     * @param v
+     * @param seed
+     */
+    BucketKDTree(std::vector<std::pair<Key, Value>> v, uint64_t seed) {
+        std::mt19937_64 engine(seed);
+        construct(v, &engine);
+    }
+
+    /**
+     * Time Complexity: O(k)
+     * @param index
+     * @return key of the point
+     */
+    Key key(size_t index) const {
+        Key result;
+        for (size_t d = 0; d < Dims; d++) result[d] = coordinates[d][index];
+        return result;
+    }
+
+    /**
+     * Time Complexity: O(1)
+     * @param index
+     * @return value of the point
+     */
+    const Value &value(size_t index) const {
+        return values[index];
+    }
+
+    /**
+     * Find the k nearest neighbors of a key with L2 distance
+     * Time Complexity: O(k log n + k LeafSize + count log count) on average for well-distributed keys
+     * @param key
+     * @param count number of neighbors
+     * @return indices of at most count points, from the nearest to the farthest
+     */
+    std::vector<size_t> nearest(const Key &key, size_t count) const {
+        std::vector<size_t> result;
+        if (count == 0 || nodes.empty()) return result;
+        NeighborHeap heap;
+        nearest(0, key, count, heap);
+        return sortedNeighbors(heap);
+    }
+
+    /**
+     * Find approximate k nearest neighbors of a key with L2 distance, best-bin-first:
+     * the leaves are searched in the order of the distances to their boxes, and the search stops
+     * once no box is closer than the farthest candidate divided by (1 + epsilon), or after maxLeaves leaves.
+     * With epsilon = 0 and no budget, the result is exact.
+     * Time Complexity: O(maxLeaves (k log n + k LeafSize + log n log maxLeaves)) with a budget
+     * @param key
+     * @param count number of neighbors
+     * @param epsilon allowed relative error of the distances without the budget
+     * @param maxLeaves maximum number of leaves to check, 0 for no limit
+     * @return indices of at most count points, from the nearest to the farthest
+     */
+    std::vector<size_t> approximateNearest(const Key &key, size_t count, double epsilon, size_t maxLeaves = 0) const {
+        if (count == 0 || nodes.empty()) return {};
+        NeighborHeap heap;
+        BranchHeap branches;
+        double factor = (1 + std::max(epsilon, 0.0)) * (1 + std::max(epsilon, 0.0));  // distances are squared
+        auto limit = [&] {
+            return heap.size() < count ? std::numeric_limits<double>::infinity() : heap.top().first / factor;
+        };
+        auto offer = [&](double distance, size_t index) {
+            if (heap.size() < count) heap.emplace(distance, index);
+            else if (distance < heap.top().first) {
+                heap.pop();
+                heap.emplace(distance, index);
+            }
+        };
+        branches.emplace(0.0, 0, 0);
+        for (size_t leaves = 0; !branches.empty() && (maxLeaves == 0 || leaves < maxLeaves); leaves++) {
+            auto branch = branches.top();
+            branches.pop();
+            if (std::get<0>(branch) >= limit()) break;
+            searchLeaf(std::get<2>(branch), key, limit(), 0, branches, offer);
+        }
+        return sortedNeighbors(heap);
+    }
+
+    /**
+     * Visit the points inside the box [lo, hi] (inclusive on every dimension)
+     * Time Complexity: O(k n^(1-1/k) + m) for well-distributed keys, m is the number of results
+     * @param lo
+     * @param hi
+     * @param visit function object, called with the index of each point inside the box
+     */
+    template<typename Visitor>
+    void range(const Key &lo, const Key &hi, Visitor visit) const {
+        if (!nodes.empty()) range(0, lo, hi, visit);
+    }
+
+    /**
+     * Count the points inside the box [lo, hi] (inclusive on every dimension)
+     * Time Complexity: O(k n^(1-1/k)) for well-distributed keys
+     */
+    size_t rangeCount(const Key &lo, const Key &hi) const {
+        return nodes.empty() ? 0 : rangeCount(0, lo, hi);
+    }
+
+    /**
+     * @return number of bytes used by the points and nodes (excluding memory owned by values)
+     */
+    size_t memoryUsage() const {
+        size_t bytes = values.capacity() * sizeof(Value) + nodes.capacity() * sizeof(Node);
+        for (auto &column : coordinates) bytes += column.capacity() * sizeof(Scalar);
+        return bytes;
+    }
+
+    size_t size() const { return values.size(); }
+};
+
+/**
+ * A forest of randomized BucketKDTrees over the same points, for approximate nearest neighbor search
+ * in higher dimensions
+ * The trees split on random ones of the dimensions with the largest spread, so they cut the space
+ * differently. A search goes best-bin-first through all trees with one queue of branches and one
+ * budget of leaves, so a neighbor on the wrong side of a split in one tree is likely to be found
+ * early in another one.
+ * Points are referred to by their indices in the input.
+ * @tparam Scalar   coordinate type, arithmetic
+ * @tparam Dims     k (number of dimensions)
+ * @tparam Value    value type
+ * @tparam LeafSize maximum number of points in a leaf
+ */
+template<typename Scalar, size_t Dims, typename Value, size_t LeafSize = 32>
+class BucketKDForest {
+public:
+    typedef std::array<Scalar, Dims> Key;
+
+protected:
+    typedef BucketKDTree<Scalar, Dims, size_t, LeafSize> Tree;     // values of the trees are indices of the points
+
+    std::vector<Tree> trees;
+    std::vector<Key> keys;
+    std::vector<Value> values;
+
+public:
+    BucketKDForest() = default;
+
+    /**
+     * Time complexity: O(t kn log n), t is the number of trees
+     * @param v
+     * @param treeCount number of trees
+     * @param seed
+     */
+    explicit BucketKDForest(std::vector<std::pair<Key, Value>> v, size_t treeCount = 4, uint64_t seed = 281) {
+        std::vector<std::pair<Key, size_t>> points;
+        points.reserve(v.size());
+        for (size_t i = 0; i < v.size(); i++) points.emplace_back(v[i].first, i);
+        trees.reserve(treeCount);
+        for (size_t i = 0; i < treeCount; i++) trees.emplace_back(points, seed + i);
+        keys.reserve(v.size());
+        values.reserve(v.size());
+        for (auto &item : v) {
+            keys.push_back(item.first);
+            values.push_back(std::move(item.second));
+        }
+    }
+
+    const Key &key(size_t index) const { return keys[index]; }
+
+    const Value &value(size_t index) const { return values[index]; }
+
+    /**
+     * Find approximate k nearest neighbors of a key with L2 distance
+     * The leaves of all trees are searched in the order of the distances to their boxes, until
+     * maxLeaves leaves are checked or no box is closer than the farthest candidate divided by (1 + epsilon)
+     * Time Complexity: O(maxLeaves (k log n + k LeafSize + log n log maxLeaves))
+     * Same parameters as BucketKDTree::approximateNearest, so the forest can replace a tree
+     * @param key
+     * @param count number of neighbors
+     * @param epsilon allowed relative error of the distances without the budget
+     * @param maxLeaves maximum number of leaves to check in all trees, 0 for no limit
+     * @return indices of at most count points, from the nearest to the farthest
+     */
+    std::vector<size_t> approximateNearest(const Key &key, size_t count, double epsilon, size_t maxLeaves = 0) const {
+        if (count == 0 || keys.empty()) return {};
+        typename Tree::NeighborHeap heap;
+        typename Tree::BranchHeap branches;
+        std::unordered_set<size_t> found;       // a point is in every tree, but can only be a candidate once
+        double factor = (1 + std::max(epsilon, 0.0)) * (1 + std::max(epsilon, 0.0));
+        auto limit = [&] {
+            return heap.size() < count ? std::numeric_limits<double>::infinity() : heap.top().first / factor;
+        };
+        size_t tree = 0;
+        auto offer = [&](double distance, size_t index) {
+            if (heap.size() == count && !(distance < heap.top().first)) return;
+            if (!found.insert(trees[tree].value(index)).second) return;
+            if (heap.size() == count) heap.pop();
+            heap.emplace(distance, trees[tree].value(index));
+        };
+        for (size_t i = 0; i < trees.size(); i++) branches.emplace(0.0, i, 0);
+        for (size_t leaves = 0; !branches.empty() && (maxLeaves == 0 || leaves < maxLeaves); leaves++) {
+            auto branch = branches.top();
+            branches.pop();
+            if (std::get<0>(branch) >= limit()) break;
+            tree = std::get<1>(branch);
+            trees[tree].searchLeaf(std::get<2>(branch), key, limit(), tree, branches, offer);
+        }
+        return Tree::sortedNeighbors(heap);
+    }
+
+    /**
+     * @return number of bytes used by the trees and points (excluding memory owned by values)
+     */
+    size_t memoryUsage() const {
+        size_t bytes = keys.capacity() * sizeof(Key) + values.capacity() * sizeof(Value);
+        for (auto &tree : trees) bytes += tree.memoryUsage();
+        return bytes;
+    }
+
+    size_t treeCount() const { return trees.size(); }
+
+    size_t size() const { return values.size(); }
+};
+
+#endif //VE281P3_BUCKET_KDTREE_HPP
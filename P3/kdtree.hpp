@@ -1,10 +1,89 @@
+#ifndef VE281P3_KDTREE_HPP
+#define VE281P3_KDTREE_HPP
+
 #include <tuple>
 #include <vector>
 #include <algorithm>
 #include <cassert>
 #include <stdexcept>
 #include <iostream>
+#include <future>
+#include <array>
+#include <atomic>
+#include <queue>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+// Compile with -DKDTREE_BOUNDING_BOX to keep the bounding box of every subtree in KDTree nodes,
+// which lets findMin / findMax (and so erase), range and nearest skip whole subtrees
+
+// define KDTREE_STATS before including this file to count the nodes visited by queries,
+// otherwise the counters are compiled out
+#ifdef KDTREE_STATS
+#define KDTREE_COUNT(statement) statement
+#else
+#define KDTREE_COUNT(statement) ((void) 0)
+#endif
+
+/**
+ * Statistics of a KDTree, returned by KDTree::statistics
+ * The counters are only collected if KDTREE_STATS is defined, otherwise they are always 0
+ */
+struct KDTreeStats {
+    size_t size = 0;                        // number of nodes
+    size_t height = 0;                      // number of levels, 0 for an empty tree
+    double averageDepth = 0;                // the root is at depth 0
+    double heightRatio = 0;                 // height / log2(n + 1), 1 for a perfectly balanced tree
+    double maxChildShare = 0;               // largest share of a child in the subtree of its parent
+    size_t leaves = 0;
+    std::vector<size_t> depthHistogram;     // depthHistogram[d] is the number of nodes at depth d
+    std::vector<size_t> splitDimensions;    // splitDimensions[d] is the number of inner nodes splitting on d
+
+    size_t lookups = 0;                     // searches of a key, including the ones done by insert and bulkInsert
+    size_t lookupVisited = 0;               // nodes visited by all lookups
+    size_t nearestQueries = 0;              // nearest, and each query of queryBatch
+    size_t nearestVisited = 0;
+    size_t rangeQueries = 0;                // range, rangeCount and withinRadius
+    size_t rangeVisited = 0;
+    size_t rebuilds = 0;                    // rebuilds of subtrees by insert, erase and bulkInsert
+    size_t rebuiltNodes = 0;                // nodes in all rebuilt subtrees
+};
+
+
+/**
+ * Distance metrics for KDTree::nearest and KDTree::withinRadius
+ * A metric works on the differences of two keys on each dimension:
+ * axis maps a difference to its contribution, combine folds the contributions,
+ * and reduce maps a radius to the same scale (L2 compares squared distances, so no sqrt is needed).
+ * combine must be monotonic, so that the distance to a box bounds the distance to every key in it.
+ */
+struct L2Metric {
+    static double axis(double diff) { return diff * diff; }
+
+    static double combine(double total, double part) { return total + part; }
+
+    static double reduce(double radius) { return radius * radius; }
+};
+
+struct L1Metric {
+    static double axis(double diff) { return std::fabs(diff); }
 
+    static double combine(double total, double part) { return total + part; }
+
+    static double reduce(double radius) { return radius; }
+};
+
+struct LinfMetric {
+    static double axis(double diff) { return std::fabs(diff); }
+
+    static double combine(double total, double part) { return std::max(total, part); }
+
+    static double reduce(double radius) { return radius; }
+};
 
 /**
  * An abstract template base of the KDTree class
@@ -37,14 +116,124 @@ protected:
         Node *parent;
         Node *left = nullptr;
         Node *right = nullptr;
+        size_t subtreeSize = 1;     // number of nodes in the subtree
+        size_t builtSize = 1;       // subtreeSize when the subtree was last built or rebuilt
+#ifdef KDTREE_BOUNDING_BOX
+        Key low = data.first;       // minimum of the subtree on each dimension
+        Key high = data.first;      // maximum of the subtree on each dimension
+#endif
 
         Node(const Key &key, const Value &value, Node *parent) : data(key, value), parent(parent) {}
 
+        Node(Key &&key, Value &&value, Node *parent) : data(std::move(key), std::move(value)), parent(parent) {}
+
         const Key &key() { return data.first; }
 
         Value &value() { return data.second; }
     };
 
+    /**
+     * An arena of nodes, allocated in blocks which are only released all at once by clear
+     * Destroyed nodes are kept in a free list and reused by later allocations,
+     * nodes never move, so pointers to them stay valid until they are destroyed
+     */
+    class NodePool {
+    private:
+        union Slot {
+            Slot *next;                                     // next slot in the free list
+            alignas(Node) unsigned char node[sizeof(Node)];
+        };
+
+        static constexpr size_t MIN_BLOCK_SIZE = 64;
+        static constexpr size_t MAX_BLOCK_SIZE = 1 << 12;   // blocks stop doubling here, except in reserve
+
+        std::vector<std::unique_ptr<Slot[]>> blocks;
+        Slot *freeList = nullptr;
+        Slot *cursor = nullptr;         // first slot of the last block that is never used
+        Slot *blockEnd = nullptr;
+        size_t capacity = 0;            // number of slots in all blocks
+
+        /**
+         * Start a new block, the unused slots of the last block are moved into the free list
+         * Time Complexity: O(1) (not counting the allocation)
+         */
+        void addBlock(size_t count) {
+            while (cursor != blockEnd) {
+                cursor->next = freeList;
+                freeList = cursor++;
+            }
+            blocks.emplace_back(new Slot[count]);
+            cursor = blocks.back().get();
+            blockEnd = cursor + count;
+            capacity += count;
+        }
+
+    public:
+        NodePool() = default;
+
+        NodePool(const NodePool &) = delete;
+
+        NodePool &operator=(const NodePool &) = delete;
+
+        /**
+         * Make sure count nodes can be created with at most one allocation
+         */
+        void reserve(size_t count) {
+            if ((size_t) (blockEnd - cursor) < count) addBlock(std::max(count, MIN_BLOCK_SIZE));
+        }
+
+        /**
+         * Construct a node in the pool, blocks grow geometrically up to MAX_BLOCK_SIZE
+         * Time Complexity: amortized O(1)
+         * @param args arguments of the constructor of Node
+         */
+        template<typename... Args>
+        Node *create(Args &&... args) {
+            Slot *slot;
+            if (freeList) {
+                slot = freeList;
+                freeList = slot->next;
+            } else {
+                if (cursor == blockEnd) addBlock(std::min(std::max(capacity, MIN_BLOCK_SIZE), MAX_BLOCK_SIZE));
+                slot = cursor++;
+            }
+            try {
+                return new(slot->node) Node(std::forward<Args>(args)...);
+            } catch (...) {
+                slot->next = freeList;
+                freeList = slot;
+                throw;
+            }
+        }
+
+        /**
+         * Destroy a node and keep its slot for later allocations
+         * Time Complexity: O(1)
+         */
+        void destroy(Node *node) {
+            node->~Node();
+            Slot *slot = reinterpret_cast<Slot *>(node);
+            slot->next = freeList;
+            freeList = slot;
+        }
+
+        /**
+         * Release all blocks at once, the nodes in them must be destroyed before
+         * unless they are trivially destructible
+         * Time Complexity: O(number of blocks)
+         */
+        void clear() {
+            blocks.clear();
+            freeList = cursor = blockEnd = nullptr;
+            capacity = 0;
+        }
+
+        /**
+         * @return bytes of the blocks
+         */
+        size_t memoryUsage() const { return capacity * sizeof(Slot); }
+    };
+
 public:
     /**
      * A bi-directional iterator for the KDTree
@@ -60,7 +249,7 @@ public:
 
         /**
          * Increment the iterator
-         * Time complexity: O(log n)
+         * Time complexity: O(log n), amortized O(1) over a full iteration
          * When a increment occurs, if the current node has a right
          * subtree, the next node should be the left most leaf in the right subtree; 
          * otherwise (if the current node doesn’t have a right subtree), 
@@ -71,12 +260,10 @@ public:
          */
         void increment() {
             // If it's the right most leaf node
-            Node* node_temp = tree->root;
-            while(node_temp->right) node_temp = node_temp->right; 
-            if(node == node_temp){
+            if(node == tree->rightmost){
                 node = nullptr;
                 return;
-            } 
+            }
 
             // If it has a right subtree
             if(node->right){
@@ -93,7 +280,7 @@ public:
 
         /**
          * Decrement the iterator
-         * Time complexity: O(log n)
+         * Time complexity: O(log n), amortized O(1) over a full iteration
          * When a decrement occurs, if the current node has a left
          * subtree, the next node should be the right most leaf in the left subtree;
          * otherwise (if the current node doesn’t have a left subtree),
@@ -106,11 +293,10 @@ public:
         void decrement() {
             // If doing an decrement on the end iterator, set next node to the right most leaf node
             if(!node){
-                Node* node_temp = tree->root;
-                while(node_temp->right) node_temp = node_temp->right; 
-                node = node_temp;
+                node = tree->rightmost;
                 return;
             }
+            if(node == tree->leftmost) throw std::range_error("decrement the begin iterator");
             
             // If it has a left subtree
             if(node->left){
@@ -173,61 +359,331 @@ public:
         }
     };
 
+    /**
+     * A lazy forward iterator over the nodes inside a box [lo, hi]
+     * Nodes are visited in pre-order with an explicit stack, and only the subtrees that
+     * intersect the box are pushed, so stopping early skips the rest of the search.
+     * The iterator is invalidated by any modification of the tree.
+     */
+    class RangeIterator {
+    private:
+        Key lo;
+        Key hi;
+        std::vector<std::pair<Node *, size_t>> stack;  // subtrees left to visit, with their dimensions
+        Node *node = nullptr;
+#ifdef KDTREE_STATS
+        std::atomic<size_t> *visited = nullptr;        // counter of the tree
+#endif
+
+        // The iterator is at the first result after the first increment
+        RangeIterator(Node *root, const Key &lo, const Key &hi) : lo(lo), hi(hi) {
+            if (root) stack.emplace_back(root, 0);
+        }
+
+        /**
+         * Move to the next node inside the box, or nullptr if there is none
+         * Time Complexity: O(k) amortized for each visited node
+         */
+        void increment() {
+            node = nullptr;
+            while (!stack.empty()) {
+                auto [current, dim] = stack.back();
+                stack.pop_back();
+                KDTREE_COUNT(if (visited) ++*visited);
+                size_t dimNext = (dim + 1) % KeySize;
+                const Key &key = current->key();
+                // The right subtree is not less than key on dim, the left subtree is less than key on dim
+                if (current->right && !lessOnDim(dim, hi, key) && boxIntersects(current->right, lo, hi)) {
+                    stack.emplace_back(current->right, dimNext);
+                }
+                if (current->left && lessOnDim(dim, lo, key) && boxIntersects(current->left, lo, hi)) {
+                    stack.emplace_back(current->left, dimNext);
+                }
+                if (inBox(key, lo, hi)) {
+                    node = current;
+                    return;
+                }
+            }
+        }
+
+    public:
+        friend class KDTree;
+
+        RangeIterator() = default;
+
+        RangeIterator &operator++() {
+            increment();
+            return *this;
+        }
+
+        RangeIterator operator++(int) {
+            RangeIterator temp = *this;
+            increment();
+            return temp;
+        }
+
+        bool operator==(const RangeIterator &that) const {
+            return node == that.node;
+        }
+
+        bool operator!=(const RangeIterator &that) const {
+            return node != that.node;
+        }
+
+        Data *operator->() {
+            return &(node->data);
+        }
+
+        Data &operator*() {
+            return node->data;
+        }
+    };
+
+    /**
+     * The result of a range query, used in range-based for loops
+     */
+    class Range {
+    private:
+        RangeIterator first;
+
+        explicit Range(RangeIterator first) : first(std::move(first)) {}
+
+    public:
+        friend class KDTree;
+
+        RangeIterator begin() const { return first; }
+
+        RangeIterator end() const { return RangeIterator(); }
+    };
+
 protected:                      // DO NOT USE private HERE!
     Node *root = nullptr;       // root of the tree
     size_t treeSize = 0;        // size of the tree
+    size_t maxSize = 0;         // maximum size since the last rebuild of the whole tree
+    Node *leftmost = nullptr;   // first node of the iteration, nullptr if empty
+    Node *rightmost = nullptr;  // last node of the iteration, nullptr if empty
+
+    static constexpr size_t PARALLEL_BUILD_CUTOFF = 1 << 14;   // build smaller subtrees in the current thread
+    static constexpr double BALANCE_ALPHA = 0.7;                // maximum share of a child in a subtree
+
+#ifdef KDTREE_STATS
+    // Atomic, so that the threads of queryBatch can count together
+    struct Counters {
+        std::atomic<size_t> lookups{0};
+        std::atomic<size_t> lookupVisited{0};
+        std::atomic<size_t> nearestQueries{0};
+        std::atomic<size_t> nearestVisited{0};
+        std::atomic<size_t> rangeQueries{0};
+        std::atomic<size_t> rangeVisited{0};
+        std::atomic<size_t> rebuilds{0};
+        std::atomic<size_t> rebuiltNodes{0};
+    };
+    Counters counters;
+#endif
+
+    NodePool pool;              // storage of all nodes
+
+    /**
+     * Move one level down towards key on each dimension from DIM to k - 1
+     * Time Complexity: O(k)
+     * @tparam DIM dimension of the node in *link
+     * @param key
+     * @param link the pointer to the current node in its parent (or root), moved to the pointer to the child
+     * @param parent set to the parent of the node in *link
+     * @return false if the search stops, i.e. *link holds key or is empty
+     */
+    template<size_t DIM = 0>
+    bool descend(const Key &key, Node **&link, Node *&parent) {
+        Node *node = *link;
+        if(!node) return false;
+        KDTREE_COUNT(counters.lookupVisited++);
+        if(key == node->key()) return false;
+        parent = node;
+        link = std::get<DIM>(key) < std::get<DIM>(node->key()) ? &node->left : &node->right;
+        if constexpr (DIM + 1 < KeySize) return descend<DIM + 1>(key, link, parent);
+        else return true;
+    }
 
     /**
-     * Find the node with key
+     * Find the node with key, iteratively, k levels in each step
      * Time Complexity: O(k log n)
-     * @tparam DIM current dimension of node
      * @param key
-     * @param node
      * @return the node with key, or nullptr if not found
      */
-    template<size_t DIM>
-    Node *find(const Key &key, Node *node) {
-        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
-        if(!node) return nullptr;
-        if(key == node->key()) return node;
-        if(std::get<DIM>(key) < std::get<DIM>(node->key())) return find<DIM_NEXT>(key, node->left);
-        else return find<DIM_NEXT>(key, node->right);
+    Node *findNode(const Key &key) {
+        KDTREE_COUNT(counters.lookups++);
+        Node **link = &root;
+        Node *parent = nullptr;
+        while(descend(key, link, parent));
+        return *link;
     }
 
     /**
      * Insert the key-value pair, if the key already exists, replace the value only
+     * The path is walked down iteratively and the sizes (and boxes) above the new node
+     * are updated through the parent pointers
      * Time Complexity: O(k log n)
-     * @tparam DIM current dimension of node
      * @param key
      * @param value
-     * @param node
-     * @param parent
+     * @param scapegoat set to the highest node on the path that is no longer alpha-weight-balanced
+     *                  and has grown enough since it was built (see grownSinceBuild)
      * @return whether insertion took place (return false if the key already exists)
      */
-    template<size_t DIM>
-    bool insert(const Key &key, const Value &value, Node *&node, Node *parent) {
-        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
-
-        // If the node is empty
-        if(!node){
-            node = new Node(key, value, parent);
-            this->treeSize++;
-            return true;
-        }
+    bool insert(const Key &key, const Value &value, Node *&scapegoat) {
+        KDTREE_COUNT(counters.lookups++);
+        Node **link = &root;
+        Node *parent = nullptr;
+        while(descend(key, link, parent));
 
         // If we find the node with the key
-        if(key == node->key()){
-            node->value() = value;
+        if(*link){
+            (*link)->value() = value;
             return false;
         }
 
-        // If not exist, insert the new pair
-        if(std::get<DIM>(key) < std::get<DIM>(node->key())) insert<DIM_NEXT>(key, value, node->left, node);
-        else insert<DIM_NEXT>(key, value, node->right, node);
-
+        *link = pool.create(key, value, parent);
+        this->treeSize++;
+        for(Node *node = parent; node; node = node->parent){
+            node->subtreeSize++;
+            extendBox(node, key, key);
+            if(!isBalanced(node) && grownSinceBuild(node, node->subtreeSize)) scapegoat = node;
+        }
         return true;
     }
 
+    /**
+     * @param node
+     * @return the pointer to node in its parent, or root
+     */
+    Node *&linkOf(Node *node) {
+        if(!node->parent) return root;
+        return node->parent->left == node ? node->parent->left : node->parent->right;
+    }
+
+    /**
+     * @param node
+     * @return number of nodes in the subtree, 0 for nullptr
+     */
+    static size_t subtreeSize(Node *node) {
+        return node ? node->subtreeSize : 0;
+    }
+
+    /**
+     * @param node
+     * @return whether none of the children of node holds more than BALANCE_ALPHA of its subtree
+     */
+    static bool isBalanced(Node *node) {
+        double limit = BALANCE_ALPHA * (double) node->subtreeSize;
+        return (double) subtreeSize(node->left) <= limit && (double) subtreeSize(node->right) <= limit;
+    }
+
+    /**
+     * Ties on the split dimension all go right, so a subtree of keys sharing many values can still
+     * be unbalanced right after a rebuild, and rebuilding it again would not help. An unbalanced
+     * subtree is only rebuilt once it has grown by 1 / BALANCE_ALPHA since it was last built,
+     * so each rebuild is paid for by as many insertions into the subtree. A subtree built from
+     * distinct values is split at the median, and can not lose its balance before growing that much
+     * @param node
+     * @param size the size of the subtree after the pending insertions
+     * @return whether the subtree has grown enough since it was built to be rebuilt
+     */
+    static bool grownSinceBuild(Node *node, size_t size) {
+        return BALANCE_ALPHA * (double) size >= (double) node->builtSize;
+    }
+
+#ifdef KDTREE_BOUNDING_BOX
+    /**
+     * Extend the bounding box of node to cover the box [low, high]
+     * Time Complexity: O(k)
+     */
+    template<size_t DIM = 0>
+    static void extendBox(Node *node, const Key &low, const Key &high) {
+        if (std::get<DIM>(low) < std::get<DIM>(node->low)) std::get<DIM>(node->low) = std::get<DIM>(low);
+        if (std::get<DIM>(node->high) < std::get<DIM>(high)) std::get<DIM>(node->high) = std::get<DIM>(high);
+        if constexpr (DIM + 1 < KeySize) extendBox<DIM + 1>(node, low, high);
+    }
+
+    /**
+     * Compute the bounding box of node from its key and the boxes of its children
+     * Time Complexity: O(k)
+     */
+    static void updateBox(Node *node) {
+        node->low = node->high = node->key();
+        if (node->left) extendBox(node, node->left->low, node->left->high);
+        if (node->right) extendBox(node, node->right->low, node->right->high);
+    }
+
+    /**
+     * @return whether the bounding box of node intersects the box [lo, hi]
+     */
+    template<size_t DIM = 0>
+    static bool boxIntersects(Node *node, const Key &lo, const Key &hi) {
+        if (std::get<DIM>(node->high) < std::get<DIM>(lo) || std::get<DIM>(hi) < std::get<DIM>(node->low)) return false;
+        if constexpr (DIM + 1 < KeySize) return boxIntersects<DIM + 1>(node, lo, hi);
+        else return true;
+    }
+
+    /**
+     * @return whether the bounding box of node is inside the box [lo, hi]
+     */
+    template<size_t DIM = 0>
+    static bool boxInside(Node *node, const Key &lo, const Key &hi) {
+        if (std::get<DIM>(node->low) < std::get<DIM>(lo) || std::get<DIM>(hi) < std::get<DIM>(node->high)) return false;
+        if constexpr (DIM + 1 < KeySize) return boxInside<DIM + 1>(node, lo, hi);
+        else return true;
+    }
+
+    /**
+     * @return distance from key to the bounding box of node in the scale of Metric
+     */
+    template<typename Metric, size_t DIM = 0>
+    static double nodeDistance(Node *node, const Key &key, double total = 0) {
+        double diff = 0;
+        if (std::get<DIM>(key) < std::get<DIM>(node->low)) {
+            diff = double(std::get<DIM>(node->low)) - double(std::get<DIM>(key));
+        } else if (std::get<DIM>(node->high) < std::get<DIM>(key)) {
+            diff = double(std::get<DIM>(key)) - double(std::get<DIM>(node->high));
+        }
+        total = Metric::combine(total, Metric::axis(diff));
+        if constexpr (DIM + 1 < KeySize) return nodeDistance<Metric, DIM + 1>(node, key, total);
+        else return total;
+    }
+
+    /**
+     * @return whether subtree may hold a node less than best on DIM
+     */
+    template<size_t DIM>
+    static bool mayContainLess(Node *subtree, Node *best) {
+        return subtree && !(std::get<DIM>(best->key()) < std::get<DIM>(subtree->low));
+    }
+
+    /**
+     * @return whether subtree may hold a node greater than best on DIM
+     */
+    template<size_t DIM>
+    static bool mayContainGreater(Node *subtree, Node *best) {
+        return subtree && !(std::get<DIM>(subtree->high) < std::get<DIM>(best->key()));
+    }
+#else
+    // Without bounding boxes, nothing can be pruned
+    static void extendBox(Node *, const Key &, const Key &) {}
+
+    static void updateBox(Node *) {}
+
+    static bool boxIntersects(Node *, const Key &, const Key &) { return true; }
+
+    static bool boxInside(Node *, const Key &, const Key &) { return false; }
+
+    template<typename Metric>
+    static double nodeDistance(Node *, const Key &) { return 0; }
+
+    template<size_t DIM>
+    static bool mayContainLess(Node *subtree, Node *) { return subtree; }
+
+    template<size_t DIM>
+    static bool mayContainGreater(Node *subtree, Node *) { return subtree; }
+#endif
+
     /**
      * Compare two keys on a dimension
      * Time Complexity: O(1)
@@ -265,7 +721,8 @@ protected:                      // DO NOT USE private HERE!
 
     /**
      * Find the minimum node on a dimension
-     * Time Complexity: ?
+     * Subtrees whose bounding boxes can not beat the current minimum are skipped
+     * Time Complexity: O(n^(1-1/k)) for a balanced tree
      * @tparam DIM_CMP comparison dimension
      * @tparam DIM current dimension of node
      * @param node
@@ -276,18 +733,25 @@ protected:                      // DO NOT USE private HERE!
         constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
 
         if(!node) return nullptr;
-        Node* min = findMin<DIM_CMP, DIM_NEXT>(node->left);
-        if(DIM_CMP != DIM){
+        Node* min = node;
+        if(mayContainLess<DIM_CMP>(node->left, min)){
+            Node* leftMin = findMin<DIM_CMP, DIM_NEXT>(node->left);
+            min = compareNode<DIM_CMP, std::less<>>(min, leftMin, std::less<>());
+        }
+        // On DIM itself, the right subtree can only hold ties of node, which are compared by the whole key
+        bool rightMayTie = DIM_CMP == DIM && !(std::get<DIM_CMP>(min->key()) < std::get<DIM_CMP>(node->key()));
+        if((DIM_CMP != DIM || rightMayTie) && mayContainLess<DIM_CMP>(node->right, min)){
             Node* rightMin = findMin<DIM_CMP, DIM_NEXT>(node->right);
             min = compareNode<DIM_CMP, std::less<>>(min, rightMin, std::less<>());
         }
-        
-        return compareNode<DIM_CMP, std::less<>>(min, node, std::less<>());
+
+        return min;
     }
 
     /**
      * Find the maximum node on a dimension
-     * Time Complexity: ?
+     * Subtrees whose bounding boxes can not beat the current maximum are skipped
+     * Time Complexity: O(n^(1-1/k)) for a balanced tree
      * @tparam DIM_CMP comparison dimension
      * @tparam DIM current dimension of node
      * @param node
@@ -298,13 +762,17 @@ protected:                      // DO NOT USE private HERE!
         constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
 
         if(!node) return nullptr;
-        Node* max = findMax<DIM_CMP, DIM_NEXT>(node->right);
-        if(DIM_CMP != DIM){
+        Node* max = node;
+        if(mayContainGreater<DIM_CMP>(node->right, max)){
+            Node* rightMax = findMax<DIM_CMP, DIM_NEXT>(node->right);
+            max = compareNode<DIM_CMP, std::greater<>>(max, rightMax, std::greater<>());
+        }
+        if(DIM_CMP != DIM && mayContainGreater<DIM_CMP>(node->left, max)){
             Node* leftMax = findMax<DIM_CMP, DIM_NEXT>(node->left);
             max = compareNode<DIM_CMP, std::greater<>>(max, leftMax, std::greater<>());
         }
 
-        return compareNode<DIM_CMP, std::greater<>>(max, node, std::greater<>());
+        return max;
     }
 
     template<size_t DIM>
@@ -344,7 +812,7 @@ protected:                      // DO NOT USE private HERE!
 
         if(key == node->key()){
             if(!node->left && !node->right){
-                delete node;
+                pool.destroy(node);
                 this->treeSize--;
                 return nullptr;
             }
@@ -360,15 +828,17 @@ protected:                      // DO NOT USE private HERE!
                 node->right = erase<DIM_NEXT>(node->right, node->key());
             }
             else if(node->left){
-                // Find the maxNode in the left subtree
-                Node* maxNode = this->findMax<DIM,DIM_NEXT>(node->left);
+                // Find the minNode in the left subtree, the max can not be used since
+                // other nodes equal to it on DIM would be left in the left subtree
+                Node* minNode = this->findMin<DIM,DIM_NEXT>(node->left);
 
-                // Replace current node with maxNode
-                node->value() = maxNode->value();
-                const_cast<Key&>(node->key()) = maxNode->key();
+                // Replace current node with minNode
+                node->value() = minNode->value();
+                const_cast<Key&>(node->key()) = minNode->key();
 
-                // Go recursively into current node's left subtrees
-                node->left = erase<DIM_NEXT>(node->left, node->key());
+                // Move the left subtree to the right, and go recursively into it
+                node->right = erase<DIM_NEXT>(node->left, node->key());
+                node->left = nullptr;
             }
         }
         else{
@@ -380,6 +850,8 @@ protected:                      // DO NOT USE private HERE!
             }
         }
 
+        node->subtreeSize = 1 + subtreeSize(node->left) + subtreeSize(node->right);
+        updateBox(node);
         return node;
     }
 
@@ -394,118 +866,566 @@ protected:                      // DO NOT USE private HERE!
         return eraseDynamic<DIM_NEXT>(node, dim);
     }
 
-    // Helper function
-    template<size_t DIM>
-    Node* KDTree_helper(std::vector<std::pair<Key, Value>> v, Node* parent){
-        if(v.empty()) return nullptr;
+    // Max-heap of (distance, node) used by nearest, the top is the farthest of the k candidates
+    typedef std::priority_queue<std::pair<double, Node *>> NeighborHeap;
+
+    /**
+     * Distance between two keys, unrolled over the dimensions at compile time
+     * Time Complexity: O(k)
+     * @tparam Metric
+     * @tparam DIM current dimension
+     * @param a
+     * @param b
+     * @param total the combined distance of the dimensions before DIM
+     * @return the distance in the scale of Metric (squared for L2Metric)
+     */
+    template<typename Metric, size_t DIM = 0>
+    static double distance(const Key &a, const Key &b, double total = 0) {
+        total = Metric::combine(total, Metric::axis(double(std::get<DIM>(a)) - double(std::get<DIM>(b))));
+        if constexpr (DIM + 1 < KeySize) return distance<Metric, DIM + 1>(a, b, total);
+        else return total;
+    }
+
+    /**
+     * Distance from a key to a box, given the offsets from the key to the box on each dimension
+     * Time Complexity: O(k)
+     */
+    template<typename Metric>
+    static double boxDistance(const std::array<double, KeySize> &offsets) {
+        double total = 0;
+        for (double offset : offsets) total = Metric::combine(total, Metric::axis(offset));
+        return total;
+    }
+
+    /**
+     * Search the k nearest nodes of key in a subtree
+     * The offsets are the distances from key to the box of the subtree on each dimension,
+     * a child on the other side of the split is only visited if its box is closer than the
+     * farthest candidate (or there are less than k candidates).
+     * With factor = reduce(1 + epsilon) > 1, a box must be closer than the farthest candidate
+     * divided by (1 + epsilon), so every result is within (1 + epsilon) times the distance of the
+     * exact neighbor of the same rank.
+     * Time Complexity: O(k log n) on average for well-distributed keys, O(kn) in the worst case
+     * @tparam Metric
+     * @tparam DIM current dimension of node
+     * @param node
+     * @param key
+     * @param count number of neighbors to find
+     * @param heap the candidates
+     * @param offsets
+     * @param factor box distances are multiplied by factor before pruning, 1 for the exact search
+     */
+    template<typename Metric, size_t DIM>
+    void nearest(Node *node, const Key &key, size_t count, NeighborHeap &heap,
+                 std::array<double, KeySize> &offsets, double factor) {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (!node) return;
+        KDTREE_COUNT(counters.nearestVisited++);
+
+        double dist = distance<Metric>(key, node->key());
+        if (heap.size() < count) heap.emplace(dist, node);
+        else if (dist < heap.top().first) {
+            heap.pop();
+            heap.emplace(dist, node);
+        }
+
+        // Keys equal on DIM are in the right subtree
+        double diff = double(std::get<DIM>(key)) - double(std::get<DIM>(node->key()));
+        Node *nearChild = diff < 0 ? node->left : node->right;
+        Node *farChild = diff < 0 ? node->right : node->left;
+        if (nearChild && (heap.size() < count || nodeDistance<Metric>(nearChild, key) * factor < heap.top().first)) {
+            nearest<Metric, DIM_NEXT>(nearChild, key, count, heap, offsets, factor);
+        }
+
+        double offset = offsets[DIM];
+        offsets[DIM] = diff;
+        if (farChild && (heap.size() < count ||
+                         std::max(boxDistance<Metric>(offsets), nodeDistance<Metric>(farChild, key)) * factor <
+                         heap.top().first)) {
+            nearest<Metric, DIM_NEXT>(farChild, key, count, heap, offsets, factor);
+        }
+        offsets[DIM] = offset;
+    }
+
+    /**
+     * Collect the nodes within radius of key in a subtree
+     * Time Complexity: O(k n^(1-1/k) + km) for well-distributed keys, m is the number of results
+     * @tparam Metric
+     * @tparam DIM current dimension of node
+     * @param node
+     * @param key
+     * @param radius reduced radius (Metric::reduce)
+     * @param result
+     * @param offsets the distances from key to the box of the subtree on each dimension
+     */
+    template<typename Metric, size_t DIM>
+    void withinRadius(Node *node, const Key &key, double radius, std::vector<Iterator> &result,
+                      std::array<double, KeySize> &offsets) {
         constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (!node) return;
+        KDTREE_COUNT(counters.rangeVisited++);
+
+        if (distance<Metric>(key, node->key()) <= radius) result.push_back(Iterator(this, node));
 
-        // Find the medium, 
-        size_t mid;
-        if(v.size() % 2 == 0) mid = v.size()/2 - 1;
-        else mid = v.size()/2;
+        double diff = double(std::get<DIM>(key)) - double(std::get<DIM>(node->key()));
+        Node *nearChild = diff < 0 ? node->left : node->right;
+        Node *farChild = diff < 0 ? node->right : node->left;
+        if (nearChild && nodeDistance<Metric>(nearChild, key) <= radius) {
+            withinRadius<Metric, DIM_NEXT>(nearChild, key, radius, result, offsets);
+        }
 
-        // Sort in this new dim
-        for(size_t i = v.size() - 1; i > 0; i--){
-            for(size_t j = 0; j < i; j++){
-                if(compareKey<DIM, std::less<>> (v[j+1].first, v[j].first, std::less<>())){
-                    std::swap(v[j], v[j+1]);
+        double offset = offsets[DIM];
+        offsets[DIM] = diff;
+        if (farChild && boxDistance<Metric>(offsets) <= radius && nodeDistance<Metric>(farChild, key) <= radius) {
+            withinRadius<Metric, DIM_NEXT>(farChild, key, radius, result, offsets);
+        }
+        offsets[DIM] = offset;
+    }
+
+    /**
+     * Convert a key to doubles, unrolled over the dimensions at compile time
+     * Time Complexity: O(k)
+     * @tparam DIM current dimension
+     * @param key
+     * @param coordinates
+     */
+    template<size_t DIM = 0>
+    static void toDoubles(const Key &key, std::array<double, KeySize> &coordinates) {
+        coordinates[DIM] = double(std::get<DIM>(key));
+        if constexpr (DIM + 1 < KeySize) toDoubles<DIM + 1>(key, coordinates);
+    }
+
+    /**
+     * Sort keys along a Z-order (Morton) curve over their bounding box,
+     * so that neighbors in the order are close in space and mostly visit the same nodes
+     * Time Complexity: O(km log m), m is the number of keys
+     * @param keys
+     * @return indices of the keys in Z-order
+     */
+    static std::vector<size_t> mortonOrder(const std::vector<Key> &keys) {
+        constexpr size_t BITS = std::min<size_t>(64 / KeySize, 32);     // bits of each dimension in a code
+        std::vector<std::array<double, KeySize>> coordinates(keys.size());
+        std::array<double, KeySize> low, high;
+        low.fill(std::numeric_limits<double>::infinity());
+        high.fill(-std::numeric_limits<double>::infinity());
+        for (size_t i = 0; i < keys.size(); i++) {
+            toDoubles(keys[i], coordinates[i]);
+            for (size_t dim = 0; dim < KeySize; dim++) {
+                low[dim] = std::min(low[dim], coordinates[i][dim]);
+                high[dim] = std::max(high[dim], coordinates[i][dim]);
+            }
+        }
+
+        // Scale each dimension to BITS bits and interleave them, from the highest bit
+        const double scale = double((uint64_t(1) << BITS) - 1);
+        std::vector<std::pair<uint64_t, size_t>> codes(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            std::array<uint64_t, KeySize> cells{};
+            for (size_t dim = 0; dim < KeySize; dim++) {
+                if (high[dim] > low[dim]) {
+                    cells[dim] = uint64_t((coordinates[i][dim] - low[dim]) / (high[dim] - low[dim]) * scale);
                 }
             }
+            uint64_t code = 0;
+            for (size_t bit = BITS; bit-- > 0;) {
+                for (size_t dim = 0; dim < KeySize; dim++) code = code << 1 | (cells[dim] >> bit & 1);
+            }
+            codes[i] = {code, i};
+        }
+        std::sort(codes.begin(), codes.end());
+
+        std::vector<size_t> order;
+        order.reserve(codes.size());
+        for (auto &code : codes) order.push_back(code.second);
+        return order;
+    }
+
+    /**
+     * Compare two keys on a dimension chosen at runtime
+     * Time Complexity: O(k)
+     * @tparam DIM current dimension
+     * @param dim comparison dimension
+     * @param a
+     * @param b
+     * @return whether a is less than b on dim
+     */
+    template<size_t DIM = 0>
+    static bool lessOnDim(size_t dim, const Key &a, const Key &b) {
+        if (dim == DIM) return std::get<DIM>(a) < std::get<DIM>(b);
+        if constexpr (DIM + 1 < KeySize) return lessOnDim<DIM + 1>(dim, a, b);
+        else return false;
+    }
+
+    /**
+     * Time Complexity: O(k)
+     * @tparam DIM current dimension
+     * @param key
+     * @param lo
+     * @param hi
+     * @return whether lo <= key <= hi on every dimension
+     */
+    template<size_t DIM = 0>
+    static bool inBox(const Key &key, const Key &lo, const Key &hi) {
+        if (std::get<DIM>(key) < std::get<DIM>(lo) || std::get<DIM>(hi) < std::get<DIM>(key)) return false;
+        if constexpr (DIM + 1 < KeySize) return inBox<DIM + 1>(key, lo, hi);
+        else return true;
+    }
+
+    /**
+     * Count the nodes inside the box [lo, hi] in a subtree
+     * lowInside[d] (highInside[d]) is set once a split above guarantees every key of the subtree
+     * is not less than lo (not greater than hi) on dimension d. When all of them are set, the
+     * subtree is fully inside the box and its size is used without visiting it.
+     * Time Complexity: O(k n^(1-1/k)) for well-distributed keys
+     * @tparam DIM current dimension of node
+     * @param node
+     * @param lo
+     * @param hi
+     * @param lowInside
+     * @param highInside
+     * @param inside number of flags set in lowInside and highInside
+     * @return number of nodes inside the box
+     */
+    template<size_t DIM>
+    size_t rangeCount(Node *node, const Key &lo, const Key &hi, std::array<bool, KeySize> &lowInside,
+                      std::array<bool, KeySize> &highInside, size_t inside) {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (!node) return 0;
+        KDTREE_COUNT(counters.rangeVisited++);
+        if (inside == 2 * KeySize || boxInside(node, lo, hi)) return node->subtreeSize;
+        if (!boxIntersects(node, lo, hi)) return 0;
+
+        size_t count = inBox(node->key(), lo, hi) ? 1 : 0;
+        const auto &split = std::get<DIM>(node->key());
+
+        // The left subtree is less than split on DIM
+        if (std::get<DIM>(lo) < split) {
+            bool previous = highInside[DIM];
+            highInside[DIM] = previous || !(std::get<DIM>(hi) < split);
+            count += rangeCount<DIM_NEXT>(node->left, lo, hi, lowInside, highInside,
+                                          inside + (highInside[DIM] && !previous));
+            highInside[DIM] = previous;
         }
+        // The right subtree is not less than split on DIM
+        if (!(std::get<DIM>(hi) < split)) {
+            bool previous = lowInside[DIM];
+            lowInside[DIM] = previous || !(split < std::get<DIM>(lo));
+            count += rangeCount<DIM_NEXT>(node->right, lo, hi, lowInside, highInside,
+                                          inside + (lowInside[DIM] && !previous));
+            lowInside[DIM] = previous;
+        }
+        return count;
+    }
+
+    /**
+     * Link nodes[begin, end) into a balanced subtree, reordering the nodes in place
+     * The node is the median on DIM, the left subtree holds the nodes less than it on DIM,
+     * and the right subtree holds the rest (including ties on DIM), which is what find expects.
+     * Subtrees with more than PARALLEL_BUILD_CUTOFF nodes are built with std::async while
+     * there are threads left.
+     * Time Complexity: O(kn log n)
+     * @tparam DIM current dimension of node
+     * @param nodes the nodes, with unique keys
+     * @param begin
+     * @param end
+     * @param parent
+     * @param threads number of threads that can be used for this subtree
+     * @return root of the subtree
+     */
+    template<size_t DIM>
+    Node *KDTree_helper(std::vector<Node *> &nodes, size_t begin, size_t end, Node *parent, size_t threads) {
+        if (begin >= end) return nullptr;
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        auto less = [](Node *a, Node *b) {
+            return compareKey<DIM, std::less<>>(a->key(), b->key(), std::less<>());
+        };
+
+        // Find the median, everything before it is not greater on DIM
+        size_t mid = begin + (end - begin - 1) / 2;
+        std::nth_element(nodes.begin() + begin, nodes.begin() + mid, nodes.begin() + end, less);
 
-        // Create 
-        std::pair<Key, Value> v_medium(v[mid]);
-        
-        // Partition data
-        std::vector<std::pair<Key, Value>> v_left(v.begin(), v.begin() + mid);
-        std::vector<std::pair<Key, Value>> v_right(v.begin() + mid + 1, v.end());
+        // Nodes equal to the median on DIM must go right, so the node is the smallest of them
+        auto first = std::partition(nodes.begin() + begin, nodes.begin() + mid, [&](Node *item) {
+            return std::get<DIM>(item->key()) < std::get<DIM>(nodes[mid]->key());
+        });
+        std::iter_swap(first, std::min_element(first, nodes.begin() + mid + 1, less));
+        mid = first - nodes.begin();
 
-        // Create a new node
-        Node* n = new Node(v_medium.first, v_medium.second, parent);
-        treeSize++;
+        Node *n = nodes[mid];
+        n->parent = parent;
+        n->subtreeSize = n->builtSize = end - begin;
 
         // Go recursively into left and right part
-        n->left = KDTree_helper<DIM_NEXT>(v_left, n);
-        n->right = KDTree_helper<DIM_NEXT>(v_right, n);
+        if (threads > 1 && end - begin > PARALLEL_BUILD_CUTOFF) {
+            auto left = std::async(std::launch::async, [&] {
+                return KDTree_helper<DIM_NEXT>(nodes, begin, mid, n, threads / 2);
+            });
+            n->right = KDTree_helper<DIM_NEXT>(nodes, mid + 1, end, n, threads - threads / 2);
+            n->left = left.get();
+        } else {
+            n->left = KDTree_helper<DIM_NEXT>(nodes, begin, mid, n, 1);
+            n->right = KDTree_helper<DIM_NEXT>(nodes, mid + 1, end, n, 1);
+        }
+        updateBox(n);
         return n;
     }
 
+    template<size_t DIM>
+    Node *rebuildDynamic(std::vector<Node *> &nodes, Node *parent, size_t dim) {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (dim >= KeySize) {
+            dim %= KeySize;
+        }
+        if (dim == DIM) return KDTree_helper<DIM>(nodes, 0, nodes.size(), parent, 1);
+        return rebuildDynamic<DIM_NEXT>(nodes, parent, dim);
+    }
+
+    /**
+     * Rebuild a subtree into a balanced one, reusing its nodes (so iterators to them stay valid)
+     * Time Complexity: O(k m log m), m is the size of the subtree
+     * @param node the pointer to the root of the subtree in its parent (or root)
+     */
+    void rebuild(Node *&node) {
+        size_t depth = 0;
+        for (auto temp = node->parent; temp; temp = temp->parent) ++depth;
+
+        std::vector<Node *> nodes;
+        nodes.reserve(node->subtreeSize);
+        collect(node, nodes);
+        KDTREE_COUNT(counters.rebuilds++);
+        KDTREE_COUNT(counters.rebuiltNodes += nodes.size());
+        node = rebuildDynamic<0>(nodes, node->parent, depth % KeySize);
+    }
+
+    /**
+     * Append the nodes of a subtree to nodes, in no particular order
+     * Time Complexity: O(m), m is the size of the subtree
+     */
+    static void collect(Node *node, std::vector<Node *> &nodes) {
+        std::vector<Node *> stack{node};
+        while (!stack.empty()) {
+            Node *current = stack.back();
+            stack.pop_back();
+            nodes.push_back(current);
+            if (current->left) stack.push_back(current->left);
+            if (current->right) stack.push_back(current->right);
+        }
+    }
+
+    /**
+     * Sort v by key (only) and keep the last pair of each key, so that later pairs replace earlier ones
+     * Time Complexity: O(kn log n)
+     * @param v
+     */
+    static void dedupe(std::vector<std::pair<Key, Value>> &v) {
+        std::stable_sort(v.begin(), v.end(), [](const std::pair<Key, Value> &a, const std::pair<Key, Value> &b) {
+            return a.first < b.first;
+        });
+        size_t kept = 0;
+        for (size_t i = 0; i < v.size(); i++) {
+            if (i + 1 < v.size() && v[i].first == v[i + 1].first) continue;
+            if (kept != i) v[kept] = std::move(v[i]);
+            kept++;
+        }
+        v.erase(v.begin() + kept, v.end());
+    }
+
+    /**
+     * Move the pairs into new nodes
+     * Time Complexity: O(n)
+     * @param v
+     * @return the new nodes, without parent and children
+     */
+    std::vector<Node *> createNodes(std::vector<std::pair<Key, Value>> &v) {
+        std::vector<Node *> nodes;
+        nodes.reserve(v.size());
+        pool.reserve(v.size());
+        for (auto &item : v) nodes.push_back(pool.create(std::move(item.first), std::move(item.second), nullptr));
+        return nodes;
+    }
+
+    /**
+     * Merge the new nodes[begin, end), whose keys are not in the tree, into a subtree
+     * The new nodes are partitioned by the split of each node on the way down. A subtree is rebuilt
+     * together with its share once one of its children would hold more than BALANCE_ALPHA of it
+     * (and it has grown enough since it was built), and an empty subtree is built from its share directly.
+     * Time Complexity: O(km log n + k s log s), s is the number of nodes in the rebuilt subtrees
+     * @tparam DIM current dimension of node
+     * @param node
+     * @param parent
+     * @param nodes
+     * @param begin
+     * @param end
+     * @param threads number of threads used to build the subtrees
+     * @return the root of the merged subtree
+     */
+    template<size_t DIM>
+    Node *merge(Node *node, Node *parent, std::vector<Node *> &nodes, size_t begin, size_t end, size_t threads) {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (begin == end) return node;
+        if (!node) return KDTree_helper<DIM>(nodes, begin, end, parent, threads);
+
+        auto middle = std::partition(nodes.begin() + begin, nodes.begin() + end, [node](Node *item) {
+            return std::get<DIM>(item->key()) < std::get<DIM>(node->key());
+        });
+        size_t mid = middle - nodes.begin();
+        double limit = BALANCE_ALPHA * (double) (node->subtreeSize + end - begin);
+        if (((double) (subtreeSize(node->left) + mid - begin) > limit ||
+             (double) (subtreeSize(node->right) + end - mid) > limit) &&
+            grownSinceBuild(node, node->subtreeSize + end - begin)) {
+            std::vector<Node *> all(nodes.begin() + begin, nodes.begin() + end);
+            all.reserve(all.size() + node->subtreeSize);
+            collect(node, all);
+            KDTREE_COUNT(counters.rebuilds++);
+            KDTREE_COUNT(counters.rebuiltNodes += all.size());
+            return KDTree_helper<DIM>(all, 0, all.size(), parent, threads);
+        }
+
+        node->left = merge<DIM_NEXT>(node->left, node, nodes, begin, mid, threads);
+        node->right = merge<DIM_NEXT>(node->right, node, nodes, mid, end, threads);
+        node->subtreeSize += end - begin;
+        updateBox(node);
+        return node;
+    }
+
+    /**
+     * Find leftmost and rightmost again after the structure of the tree changes
+     * Time Complexity: O(log n)
+     */
+    void updateExtremes() {
+        leftmost = rightmost = root;
+        if (!root) return;
+        while (leftmost->left) leftmost = leftmost->left;
+        while (rightmost->right) rightmost = rightmost->right;
+    }
+
+    /**
+     * Rebuild the whole tree once its size drops below BALANCE_ALPHA of its maximum size
+     * Time Complexity: amortized O(k log n)
+     */
+    void rebalanceAfterErase() {
+        if ((double) treeSize >= BALANCE_ALPHA * (double) maxSize) return;
+        if (root) rebuild(root);
+        maxSize = treeSize;
+    }
+
+    /**
+     * Copy a subtree into the pool, iteratively with an explicit stack
+     * Time complexity: O(n)
+     * @param root
+     * @param parent_root parent of the copy
+     * @return the copy of root
+     */
     Node* copy_node(Node* root, Node* parent_root){
         if(!root) return nullptr;
 
-        Node* node_copy = new Node(root->key(), root->value(), parent_root);
-        
-        if(root->left) node_copy->left = copy_node(root->left, node_copy);
-        if(root->right) node_copy->right = copy_node(root->right, node_copy);
-
-        return node_copy;
+        Node* root_copy = pool.create(*root);
+        root_copy->parent = parent_root;
+        std::vector<Node *> stack{root_copy};
+        while(!stack.empty()){
+            // Children of node still point into the source tree
+            Node* node = stack.back();
+            stack.pop_back();
+            if(node->left){
+                node->left = pool.create(*node->left);
+                node->left->parent = node;
+                stack.push_back(node->left);
+            }
+            if(node->right){
+                node->right = pool.create(*node->right);
+                node->right->parent = node;
+                stack.push_back(node->right);
+            }
+        }
+        return root_copy;
     }
 
-    void Destroy_helper(Node *root){
-        if(root != nullptr){
-            Destroy_helper(root->left);
-            Destroy_helper(root->right);
-            delete root;
+    /**
+     * Destroy all nodes and release the pool, iteratively through the parent pointers
+     * Time complexity: O(n), O(number of blocks) if nodes are trivially destructible
+     */
+    void Destroy_helper(){
+        if constexpr (!std::is_trivially_destructible<Node>::value){
+            Node* node = root;
+            while(node){
+                if(node->left) node = node->left;
+                else if(node->right) node = node->right;
+                else{
+                    Node* parent = node->parent;
+                    if(parent && parent->left == node) parent->left = nullptr;
+                    else if(parent) parent->right = nullptr;
+                    node->~Node();
+                    node = parent;
+                }
+            }
         }
+        pool.clear();
+        root = leftmost = rightmost = nullptr;
     }
 
 public:
     KDTree() = default;
 
     /**
+     * Build the tree, if a key appears more than once the last value is kept
+     * The keys and values are moved into the nodes, and only the node pointers are sorted
      * Time complexity: O(kn log n)
-     * @param v we pass by value here because v need to be modified
-     */
-    explicit KDTree(std::vector<std::pair<Key, Value>> v) {
-        // Sort
-        std::stable_sort(v.begin(), v.end());    
-        
-        // Reverse the vector
-        for(size_t i = 0; i < v.size()/2; i++) std::swap(v[i], v[v.size() - i - 1]);
-
-        // Unique
-        for(size_t i = 0; i < v.size() - 1; i++){
-            if(v[i].first == v[i+1].first){
-                auto it = v.begin() + i;
-                v.erase(it);
-            }
-        }
-        
-        // Helper           
-        root = KDTree_helper<0>(v, nullptr);         
+     * @param v pass an rvalue to move the keys and values instead of copying them
+     * @param threads number of threads used to build the tree
+     */
+    explicit KDTree(std::vector<std::pair<Key, Value>> v, size_t threads = 1) {
+        dedupe(v);
+        std::vector<Node *> nodes = createNodes(v);
+        root = KDTree_helper<0>(nodes, 0, nodes.size(), nullptr, std::max<size_t>(threads, 1));
+        treeSize = maxSize = nodes.size();
+        updateExtremes();
     }
 
+    /**
+     * Build the tree from a range of key-value pairs, if a key appears more than once the last value is kept
+     * Time complexity: O(kn log n)
+     * @param first
+     * @param last
+     * @param threads number of threads used to build the tree
+     */
+    template<typename InputIterator>
+    KDTree(InputIterator first, InputIterator last, size_t threads = 1)
+            : KDTree(std::vector<std::pair<Key, Value>>(first, last), threads) {}
+
     /**
      * Time complexity: O(n)
      */
     KDTree(const KDTree &that) {
+        pool.reserve(that.treeSize);
         this->root = this->copy_node(that.root, nullptr);
         this->treeSize = that.treeSize;
+        this->maxSize = that.maxSize;
+        updateExtremes();
     }
 
     /**
      * Time complexity: O(n)
      */
     KDTree &operator=(const KDTree &that) {
-        Destroy_helper(this->root);
+        if (this == &that) return *this;
+        Destroy_helper();
+        pool.reserve(that.treeSize);
         this->root = this->copy_node(that.root, nullptr);
         this->treeSize = that.treeSize;
+        this->maxSize = that.maxSize;
+        updateExtremes();
         return *this;
     }
 
     /**
-     * Time complexity: O(n)
+     * Time complexity: O(n), O(number of blocks) if keys and values are trivially destructible
      */
     ~KDTree() {
-        Destroy_helper(this->root);
+        Destroy_helper();
     }
 
     Iterator begin() {
-        if (!root) return end();
-        auto node = root;
-        while (node->left) node = node->left;
-        return Iterator(this, node);
+        return Iterator(this, leftmost);
     }
 
     Iterator end() {
@@ -513,11 +1433,51 @@ public:
     }
 
     Iterator find(const Key &key) {
-        return Iterator(this, find<0>(key, root));
+        return Iterator(this, findNode(key));
     }
 
+    /**
+     * Insert the key-value pair, if the key already exists, replace the value only
+     * The highest subtree that is no longer alpha-weight-balanced is rebuilt,
+     * which keeps the depth O(log n)
+     * Time complexity: amortized O(k log^2 n)
+     */
     void insert(const Key &key, const Value &value) {
-        insert<0>(key, value, root, nullptr);
+        Node *scapegoat = nullptr;
+        if (!insert(key, value, scapegoat)) return;
+        maxSize = std::max(maxSize, treeSize);
+        if (scapegoat) rebuild(linkOf(scapegoat));
+        updateExtremes();
+    }
+
+    /**
+     * Insert a batch of key-value pairs, keys already in the tree are updated, and if a key
+     * appears more than once in the batch the last value is kept
+     * The new nodes are merged into the tree top-down, only the subtrees that would become
+     * unbalanced are rebuilt, so a large batch costs about a rebuild instead of m inserts
+     * Time complexity: O(km log(n + m) + k s log s), s is the number of nodes in the rebuilt subtrees
+     * @param v pass an rvalue to move the keys and values instead of copying them
+     * @param threads number of threads used to build the subtrees
+     */
+    void bulkInsert(std::vector<std::pair<Key, Value>> v, size_t threads = 1) {
+        dedupe(v);
+        // Keys already in the tree only update the values
+        size_t added = 0;
+        for (size_t i = 0; i < v.size(); i++) {
+            if (Node *existing = findNode(v[i].first)) {
+                existing->value() = std::move(v[i].second);
+            } else {
+                if (added != i) v[added] = std::move(v[i]);
+                added++;
+            }
+        }
+        v.erase(v.begin() + added, v.end());
+
+        std::vector<Node *> nodes = createNodes(v);
+        root = merge<0>(root, nullptr, nodes, 0, nodes.size(), std::max<size_t>(threads, 1));
+        treeSize += added;
+        maxSize = std::max(maxSize, treeSize);
+        updateExtremes();
     }
 
     template<size_t DIM>
@@ -538,10 +1498,138 @@ public:
         return Iterator(this, findMaxDynamic<0>(dim));
     }
 
+    /**
+     * Find the k nearest neighbors of a key
+     * With epsilon > 0 the search is approximate: the i-th result is at most (1 + epsilon) times
+     * as far as the exact i-th nearest neighbor, and much fewer nodes are visited in high dimensions
+     * Time Complexity: O(k log n + count log count) on average for well-distributed keys
+     * @tparam Metric L2Metric, L1Metric, LinfMetric or a user-defined metric with the same interface
+     * @param key
+     * @param count number of neighbors
+     * @param epsilon allowed relative error of the distances, 0 for the exact neighbors
+     * @return iterators of at most count nodes, from the nearest to the farthest
+     */
+    template<typename Metric = L2Metric>
+    std::vector<Iterator> nearest(const Key &key, size_t count, double epsilon = 0) {
+        std::vector<Iterator> result;
+        if (count == 0) return result;
+        KDTREE_COUNT(counters.nearestQueries++);
+        NeighborHeap heap;
+        std::array<double, KeySize> offsets{};
+        nearest<Metric, 0>(root, key, count, heap, offsets, Metric::reduce(1 + std::max(epsilon, 0.0)));
+        result.reserve(heap.size());
+        while (!heap.empty()) {
+            result.push_back(Iterator(this, heap.top().second));
+            heap.pop();
+        }
+        std::reverse(result.begin(), result.end());
+        return result;
+    }
+
+    /**
+     * Find the k nearest neighbors of a batch of keys
+     * The queries are sorted in Z-order for cache locality and split into contiguous runs,
+     * one for each thread, every thread keeps its own candidate heap and writes its results
+     * into one preallocated array
+     * Time Complexity: O(m log m + m (k log n + count log count) / threads) on average, m is the number of queries
+     * @tparam Metric L2Metric, L1Metric, LinfMetric or a user-defined metric with the same interface
+     * @param queries
+     * @param count number of neighbors of each query
+     * @param threads number of threads
+     * @return queries.size() * count iterators, the neighbors of queries[i] are at [i * count, (i + 1) * count)
+     * from the nearest to the farthest, padded with end() if the tree has less than count nodes
+     */
+    template<typename Metric = L2Metric>
+    std::vector<Iterator> queryBatch(const std::vector<Key> &queries, size_t count, size_t threads = 1) {
+        std::vector<Iterator> result(queries.size() * count, end());
+        if (count == 0 || queries.empty()) return result;
+        std::vector<size_t> order = mortonOrder(queries);
+
+        auto search = [&](size_t first, size_t last) {
+            NeighborHeap heap;
+            for (size_t i = first; i < last; i++) {
+                size_t query = order[i];
+                KDTREE_COUNT(counters.nearestQueries++);
+                std::array<double, KeySize> offsets{};
+                nearest<Metric, 0>(root, queries[query], count, heap, offsets, 1);
+                // The heap pops the farthest candidate first
+                for (size_t slot = heap.size(); slot-- > 0; heap.pop()) {
+                    result[query * count + slot] = Iterator(this, heap.top().second);
+                }
+            }
+        };
+
+        threads = std::max<size_t>(1, std::min(threads, queries.size()));
+        std::vector<std::future<void>> tasks;
+        for (size_t thread = 1; thread < threads; thread++) {
+            tasks.push_back(std::async(std::launch::async, search, queries.size() * thread / threads,
+                                       queries.size() * (thread + 1) / threads));
+        }
+        search(0, queries.size() / threads);
+        for (auto &task : tasks) task.get();
+        return result;
+    }
+
+    /**
+     * Find all nodes within a distance of a key (inclusive)
+     * Time Complexity: O(k n^(1-1/k) + km) for well-distributed keys, m is the number of results
+     * @tparam Metric L2Metric, L1Metric, LinfMetric or a user-defined metric with the same interface
+     * @param key
+     * @param radius
+     * @return iterators of the nodes, in no particular order
+     */
+    template<typename Metric = L2Metric>
+    std::vector<Iterator> withinRadius(const Key &key, double radius) {
+        std::vector<Iterator> result;
+        if (radius < 0) return result;
+        KDTREE_COUNT(counters.rangeQueries++);
+        std::array<double, KeySize> offsets{};
+        withinRadius<Metric, 0>(root, key, Metric::reduce(radius), result, offsets);
+        return result;
+    }
+
+    /**
+     * Query the nodes inside the box [lo, hi] (inclusive on every dimension)
+     * The search is lazy, each increment of the iterator continues it until the next result
+     * Time Complexity: O(k) to start, O(k n^(1-1/k) + km) to iterate all m results
+     * @param lo
+     * @param hi
+     * @return a range of the results, in no particular order
+     */
+    Range range(const Key &lo, const Key &hi) {
+        RangeIterator first(root, lo, hi);
+        KDTREE_COUNT(counters.rangeQueries++);
+        KDTREE_COUNT(first.visited = &counters.rangeVisited);
+        first.increment();
+        return Range(std::move(first));
+    }
+
+    /**
+     * Count the nodes inside the box [lo, hi] (inclusive on every dimension)
+     * Subtrees fully inside the box are counted by their sizes
+     * Time Complexity: O(k n^(1-1/k)) for well-distributed keys
+     * @param lo
+     * @param hi
+     * @return number of nodes inside the box
+     */
+    size_t rangeCount(const Key &lo, const Key &hi) {
+        KDTREE_COUNT(counters.rangeQueries++);
+        std::array<bool, KeySize> lowInside{}, highInside{};
+        return rangeCount<0>(root, lo, hi, lowInside, highInside, 0);
+    }
+
+    /**
+     * Erase the node with key, the whole tree is rebuilt once its size drops below
+     * BALANCE_ALPHA of its maximum size since the last rebuild
+     * Time complexity: amortized O(findMin + k log n)
+     */
     bool erase(const Key &key) {
         auto prevSize = treeSize;
-        erase<0>(root, key);
-        return prevSize > treeSize;
+        root = erase<0>(root, key);
+        if (prevSize == treeSize) return false;
+        rebalanceAfterErase();
+        updateExtremes();
+        return true;
     }
 
     Iterator erase(Iterator it) {
@@ -556,9 +1644,113 @@ public:
             temp = temp->parent;
             ++depth;
         }
-        eraseDynamic<0>(node, depth % KeySize);
+        // Relink the parent (node is deleted if it was a leaf) and update the sizes above it
+        auto parent = node->parent;
+        bool isLeft = parent && parent->left == node;
+        auto replaced = eraseDynamic<0>(node, depth % KeySize);
+        if (!parent) root = replaced;
+        else if (isLeft) parent->left = replaced;
+        else parent->right = replaced;
+        for (temp = parent; temp; temp = temp->parent) {
+            temp->subtreeSize--;
+            updateBox(temp);
+        }
+        rebalanceAfterErase();
+        updateExtremes();
         return it;
     }
 
+    /**
+     * Visit all nodes in the order of iteration, with an explicit stack instead of parent pointers
+     * Time complexity: O(n)
+     * @param visit function object, called with the Data of each node
+     */
+    template<typename Visitor>
+    void forEach(Visitor visit) {
+        std::vector<Node *> stack;
+        Node *node = root;
+        while (node || !stack.empty()) {
+            while (node) {
+                stack.push_back(node);
+                node = node->left;
+            }
+            node = stack.back();
+            stack.pop_back();
+            visit(node->data);
+            node = node->right;
+        }
+    }
+
     size_t size() const { return treeSize; }
+
+    /**
+     * Collect the statistics of the tree
+     * The shape of the tree is computed on each call, the counters are collected
+     * during queries and rebuilds if KDTREE_STATS is defined
+     * Time Complexity: O(n)
+     * @return the statistics
+     */
+    KDTreeStats statistics() const {
+        KDTreeStats stats;
+#ifdef KDTREE_STATS
+        stats.lookups = counters.lookups;
+        stats.lookupVisited = counters.lookupVisited;
+        stats.nearestQueries = counters.nearestQueries;
+        stats.nearestVisited = counters.nearestVisited;
+        stats.rangeQueries = counters.rangeQueries;
+        stats.rangeVisited = counters.rangeVisited;
+        stats.rebuilds = counters.rebuilds;
+        stats.rebuiltNodes = counters.rebuiltNodes;
+#endif
+        stats.size = treeSize;
+        stats.splitDimensions.assign(KeySize, 0);
+        size_t totalDepth = 0;
+        std::vector<std::pair<Node *, size_t>> stack;
+        if (root) stack.emplace_back(root, 0);
+        while (!stack.empty()) {
+            auto [node, depth] = stack.back();
+            stack.pop_back();
+            if (depth >= stats.depthHistogram.size()) stats.depthHistogram.resize(depth + 1, 0);
+            stats.depthHistogram[depth]++;
+            totalDepth += depth;
+            if (!node->left && !node->right) {
+                stats.leaves++;
+                continue;
+            }
+            stats.splitDimensions[depth % KeySize]++;
+            size_t child = std::max(subtreeSize(node->left), subtreeSize(node->right));
+            stats.maxChildShare = std::max(stats.maxChildShare, (double) child / (double) node->subtreeSize);
+            if (node->left) stack.emplace_back(node->left, depth + 1);
+            if (node->right) stack.emplace_back(node->right, depth + 1);
+        }
+        stats.height = stats.depthHistogram.size();
+        if (treeSize > 0) {
+            stats.averageDepth = (double) totalDepth / (double) treeSize;
+            stats.heightRatio = (double) stats.height / std::log2((double) treeSize + 1);
+        }
+        return stats;
+    }
+
+    /**
+     * Reset the query and rebuild counters to 0, e.g. between the phases of a benchmark
+     */
+    void resetStatistics() {
+#ifdef KDTREE_STATS
+        counters.lookups = 0;
+        counters.lookupVisited = 0;
+        counters.nearestQueries = 0;
+        counters.nearestVisited = 0;
+        counters.rangeQueries = 0;
+        counters.rangeVisited = 0;
+        counters.rebuilds = 0;
+        counters.rebuiltNodes = 0;
+#endif
+    }
+
+    /**
+     * @return bytes used by the nodes, including the free slots in the pool
+     */
+    size_t memoryUsage() const { return pool.memoryUsage(); }
 };
+
+#endif //VE281P3_KDTREE_HPP
@@ -0,0 +1,460 @@
+// Benchmark of the pointer KDTree against StaticKDTree and BucketKDTree
+// Build with: g++ -std=c++17 -O2 -march=native -pthread main.cpp -o main
+// Add -DKDTREE_BOUNDING_BOX to measure KDTree with per-subtree bounding boxes
+// Add -DKDTREE_STATS to also report the nodes visited per query of KDTree
+// Usage: ./main [number of points] [number of queries] [maximum number of threads]
+#include "kdtree.hpp"
+#include "static_kdtree.hpp"
+#include "bucket_kdtree.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+#include <random>
+#include <set>
+#include <thread>
+using namespace std;
+
+typedef tuple<int, int, int> Key;
+typedef KDTree<Key, int> PointerTree;
+typedef StaticKDTree<Key, int> ArrayTree;
+typedef BucketKDTree<float, 3, int> BucketTree;  // coordinates are below 2^24, so float is exact
+
+static constexpr int COORDINATE_RANGE = 1 << 20;
+
+// Keys of the approximate nearest neighbor benchmark
+static constexpr size_t HIGH_DIMS = 16;
+template<size_t... I>
+tuple<decltype(float(I))...> repeatFloat(index_sequence<I...>);
+typedef decltype(repeatFloat(make_index_sequence<HIGH_DIMS>())) HighKey;
+typedef array<float, HIGH_DIMS> HighPoint;
+
+struct Workload {
+    string name;
+    vector<pair<Key, int>> points;
+    vector<Key> lookups;            // keys to find, all of them are in the tree
+    vector<Key> queries;            // centers of nearest neighbor and range queries
+    vector<Key> inserts;            // keys to insert into and then erase from KDTree
+    int boxSide;                    // side of the range query boxes
+};
+
+template<typename Function>
+double nanosecondsPerOp(size_t ops, Function function) {
+    auto start = chrono::steady_clock::now();
+    function();
+    auto end = chrono::steady_clock::now();
+    return chrono::duration<double, nano>(end - start).count() / (double) max<size_t>(ops, 1);
+}
+
+// Prevent the compiler from removing the queries
+volatile size_t sink;
+
+/**
+ * Time every call of function(i) for i in [0, ops) separately
+ * @return the latencies in nanoseconds, sorted
+ */
+template<typename Function>
+vector<double> latencies(size_t ops, Function function) {
+    vector<double> result(ops);
+    for (size_t i = 0; i < ops; i++) {
+        auto start = chrono::steady_clock::now();
+        function(i);
+        auto end = chrono::steady_clock::now();
+        result[i] = chrono::duration<double, nano>(end - start).count();
+    }
+    sort(result.begin(), result.end());
+    return result;
+}
+
+double percentile(const vector<double> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    return sorted[min(sorted.size() - 1, (size_t) (p * (double) sorted.size()))];
+}
+
+Key boxCorner(const Key &center, int offset) {
+    return Key(get<0>(center) + offset, get<1>(center) + offset, get<2>(center) + offset);
+}
+
+BucketTree::Key bucketKey(const Key &key) {
+    return {(float) get<0>(key), (float) get<1>(key), (float) get<2>(key)};
+}
+
+void runWorkload(const Workload &workload, size_t maxThreads) {
+    size_t found;
+    size_t n = workload.points.size();
+    int half = workload.boxSide / 2;
+
+    PointerTree *pointerTree = nullptr;
+    ArrayTree *arrayTree = nullptr;
+    double pointerBuild = nanosecondsPerOp(1, [&] { pointerTree = new PointerTree(workload.points); });
+    double arrayBuild = nanosecondsPerOp(1, [&] { arrayTree = new ArrayTree(workload.points); });
+    vector<pair<BucketTree::Key, int>> bucketPoints;
+    for (auto &point : workload.points) bucketPoints.emplace_back(bucketKey(point.first), point.second);
+    BucketTree *bucketTree = nullptr;
+    double bucketBuild = nanosecondsPerOp(1, [&] { bucketTree = new BucketTree(bucketPoints); });
+
+    double pointerFind = nanosecondsPerOp(workload.lookups.size(), [&] {
+        found = 0;
+        for (auto &key : workload.lookups) found += pointerTree->find(key) != pointerTree->end();
+        sink = found;
+    });
+    double arrayFind = nanosecondsPerOp(workload.lookups.size(), [&] {
+        found = 0;
+        for (auto &key : workload.lookups) found += arrayTree->find(key) != ArrayTree::npos;
+        sink = found;
+    });
+    // Save the StaticKDTree and map the file back, the mapped tree answers find without loading
+    string path = "main_static_kdtree.bin";
+    double arraySave = nanosecondsPerOp(1, [&] { arrayTree->save(path); });
+    ArrayTree *mappedTree = nullptr;
+    double arrayMap = nanosecondsPerOp(1, [&] { mappedTree = new ArrayTree(ArrayTree::map(path)); });
+    double mappedFind = nanosecondsPerOp(workload.lookups.size(), [&] {
+        found = 0;
+        for (auto &key : workload.lookups) found += mappedTree->find(key) != ArrayTree::npos;
+        sink = found;
+    });
+    delete mappedTree;
+    remove(path.c_str());
+
+    double pointerNearest = nanosecondsPerOp(workload.queries.size(), [&] {
+        found = 0;
+        for (auto &key : workload.queries) found += pointerTree->nearest(key, 10).size();
+        sink = found;
+    });
+    double arrayNearest = nanosecondsPerOp(workload.queries.size(), [&] {
+        found = 0;
+        for (auto &key : workload.queries) found += arrayTree->nearest(key, 10).size();
+        sink = found;
+    });
+    double bucketNearest = nanosecondsPerOp(workload.queries.size(), [&] {
+        found = 0;
+        for (auto &key : workload.queries) found += bucketTree->nearest(bucketKey(key), 10).size();
+        sink = found;
+    });
+    size_t pointerRangeResults = 0, arrayRangeResults = 0, bucketRangeResults = 0;
+    double pointerRange = nanosecondsPerOp(workload.queries.size(), [&] {
+        for (auto &key : workload.queries) {
+            for (auto &data : pointerTree->range(boxCorner(key, -half), boxCorner(key, half))) {
+                pointerRangeResults += (size_t) data.second;
+            }
+        }
+        sink = pointerRangeResults;
+    });
+    double arrayRange = nanosecondsPerOp(workload.queries.size(), [&] {
+        for (auto &key : workload.queries) {
+            arrayTree->range(boxCorner(key, -half), boxCorner(key, half), [&](size_t index) {
+                arrayRangeResults += (size_t) arrayTree->value(index);
+            });
+        }
+        sink = arrayRangeResults;
+    });
+    double bucketRange = nanosecondsPerOp(workload.queries.size(), [&] {
+        for (auto &key : workload.queries) {
+            bucketTree->range(bucketKey(boxCorner(key, -half)), bucketKey(boxCorner(key, half)), [&](size_t index) {
+                bucketRangeResults += (size_t) bucketTree->value(index);
+            });
+        }
+        sink = bucketRangeResults;
+    });
+
+    double pointerMin = nanosecondsPerOp(3 * 100, [&] {
+        found = 0;
+        for (size_t i = 0; i < 100 && n > 0; i++) {
+            for (size_t dim = 0; dim < 3; dim++) found += (size_t) pointerTree->findMin(dim)->second;
+        }
+        sink = found;
+    });
+    double arrayMin = nanosecondsPerOp(3 * 100, [&] {
+        found = 0;
+        for (size_t i = 0; i < 100 && n > 0; i++) {
+            for (size_t dim = 0; dim < 3; dim++) found += (size_t) arrayTree->value(arrayTree->findMin(dim));
+        }
+        sink = found;
+    });
+    double pointerInsert = nanosecondsPerOp(workload.inserts.size(), [&] {
+        for (auto &key : workload.inserts) pointerTree->insert(key, 1);
+    });
+    double pointerErase = nanosecondsPerOp(workload.inserts.size(), [&] {
+        found = 0;
+        for (auto &key : workload.inserts) found += pointerTree->erase(key);
+        sink = found;
+    });
+    vector<pair<Key, int>> batch;
+    for (auto &key : workload.inserts) batch.emplace_back(key, 1);
+    double pointerBulkInsert = nanosecondsPerOp(batch.size(), [&] { pointerTree->bulkInsert(move(batch)); });
+
+    double pointerMemory = (double) pointerTree->memoryUsage() / (1 << 20);
+    double arrayMemory = (double) arrayTree->memoryUsage() / (1 << 20);
+    double bucketMemory = (double) bucketTree->memoryUsage() / (1 << 20);
+
+    cout << "== " << workload.name << " (" << n << " points, " << workload.queries.size() << " queries, "
+         << (double) arrayRangeResults / (double) max<size_t>(workload.queries.size(), 1)
+         << " points per range query)" << endl;
+    cout << "                       KDTree  StaticKDTree  BucketKDTree" << endl;
+    cout << "build (ms)        " << setw(12) << pointerBuild / 1e6 << setw(14) << arrayBuild / 1e6
+         << setw(14) << bucketBuild / 1e6 << endl;
+    cout << "memory (MB)       " << setw(12) << pointerMemory << setw(14) << arrayMemory << setw(14) << bucketMemory << endl;
+    cout << "find (ns/op)      " << setw(12) << pointerFind << setw(14) << arrayFind << setw(14) << "-" << endl;
+    cout << "save (ms)         " << setw(12) << "-" << setw(14) << arraySave / 1e6 << setw(14) << "-" << endl;
+    cout << "map (ms)          " << setw(12) << "-" << setw(14) << arrayMap / 1e6 << setw(14) << "-" << endl;
+    cout << "find mapped (ns/op)" << setw(11) << "-" << setw(14) << mappedFind << setw(14) << "-" << endl;
+    cout << "nearest 10 (ns/op)" << setw(12) << pointerNearest << setw(14) << arrayNearest
+         << setw(14) << bucketNearest << endl;
+    cout << "range (ns/op)     " << setw(12) << pointerRange << setw(14) << arrayRange << setw(14) << bucketRange << endl;
+    cout << "findMin (ns/op)   " << setw(12) << pointerMin << setw(14) << arrayMin << setw(14) << "-" << endl;
+    cout << "insert (ns/op)    " << setw(12) << pointerInsert << setw(14) << "-" << setw(14) << "-" << endl;
+    cout << "erase (ns/op)     " << setw(12) << pointerErase << setw(14) << "-" << setw(14) << "-" << endl;
+    cout << "bulkInsert (ns/op)" << setw(12) << pointerBulkInsert << setw(14) << "-" << setw(14) << "-" << endl;
+    if (pointerRangeResults != arrayRangeResults || pointerRangeResults != bucketRangeResults) {
+        cout << "range results differ!" << endl;
+    }
+
+    // KDTree::queryBatch on 1 to N threads, against the loop of single queries above
+    vector<size_t> threadCounts;
+    for (size_t threads = 1; threads < maxThreads; threads *= 2) threadCounts.push_back(threads);
+    threadCounts.push_back(maxThreads);
+    for (size_t threads : threadCounts) {
+        double batchNearest = nanosecondsPerOp(workload.queries.size(), [&] {
+            sink = pointerTree->queryBatch(workload.queries, 10, threads).size();
+        });
+        cout << "queryBatch 10, " << threads << " thread(s) (ns/op) " << setw(10) << batchNearest
+             << " (x" << pointerNearest / batchNearest << ")" << endl;
+    }
+    cout << endl;
+
+    delete pointerTree;
+    delete arrayTree;
+    delete bucketTree;
+}
+
+/**
+ * Build time, memory, latency percentiles and tree quality of KDTree on a workload
+ * @param incremental build the tree by inserting the points one by one in their order,
+ *        instead of with the bulk-load constructor
+ */
+void profileWorkload(const Workload &workload, bool incremental) {
+    int half = workload.boxSide / 2;
+    PointerTree *tree = nullptr;
+    double build = nanosecondsPerOp(1, [&] {
+        if (incremental) {
+            tree = new PointerTree();
+            for (auto &point : workload.points) tree->insert(point.first, point.second);
+        } else {
+            tree = new PointerTree(workload.points);
+        }
+    });
+    KDTreeStats buildStats = tree->statistics();
+    tree->resetStatistics();
+
+    auto find = latencies(workload.lookups.size(), [&](size_t i) {
+        sink = tree->find(workload.lookups[i]) != tree->end();
+    });
+    auto range = latencies(workload.queries.size(), [&](size_t i) {
+        size_t count = 0;
+        for (auto &data : tree->range(boxCorner(workload.queries[i], -half), boxCorner(workload.queries[i], half))) {
+            count += (size_t) data.second;
+        }
+        sink = count;
+    });
+    auto nearest = latencies(workload.queries.size(), [&](size_t i) {
+        sink = tree->nearest(workload.queries[i], 10).size();
+    });
+    KDTreeStats stats = tree->statistics();
+
+    cout << "== profile " << workload.name << (incremental ? ", inserted one by one" : ", bulk-loaded")
+         << " (" << workload.points.size() << " points)" << endl;
+    cout << "build (ms)        " << setw(12) << build / 1e6 << endl;
+    cout << "memory (MB)       " << setw(12) << (double) tree->memoryUsage() / (1 << 20) << endl;
+    cout << "rebuilds          " << setw(12) << buildStats.rebuilds << " (" << buildStats.rebuiltNodes
+         << " nodes, counted with KDTREE_STATS)" << endl;
+    cout << "height            " << setw(12) << stats.height << " (x" << setprecision(2) << stats.heightRatio
+         << " of log2(n + 1))" << endl;
+    cout << "average depth     " << setw(12) << stats.averageDepth << endl;
+    cout << "max child share   " << setw(12) << stats.maxChildShare << setprecision(1) << endl;
+    cout << "leaves            " << setw(12) << stats.leaves << endl;
+    cout << "split dimensions  ";
+    for (size_t count : stats.splitDimensions) cout << setw(12) << count;
+    cout << endl;
+    cout << "depth histogram   ";
+    for (size_t depth = 0; depth < stats.depthHistogram.size(); depth++) {
+        if (depth % 8 == 0 && depth > 0) cout << endl << "                  ";
+        cout << " " << depth << ":" << stats.depthHistogram[depth];
+    }
+    cout << endl;
+    cout << "latency (ns)             p50         p90         p99    visited/query" << endl;
+    auto report = [&](const string &name, const vector<double> &sorted, size_t queries, size_t visited) {
+        cout << left << setw(18) << name << right << setw(12) << percentile(sorted, 0.5)
+             << setw(12) << percentile(sorted, 0.9) << setw(12) << percentile(sorted, 0.99)
+             << setw(17) << (double) visited / (double) max<size_t>(queries, 1) << endl;
+    };
+    report("find", find, stats.lookups, stats.lookupVisited);
+    report("range", range, stats.rangeQueries, stats.rangeVisited);
+    report("nearest 10", nearest, stats.nearestQueries, stats.nearestVisited);
+    cout << endl;
+
+    delete tree;
+}
+
+/**
+ * Recall and latency of the approximate nearest neighbor modes on clustered 16-D points,
+ * like the feature vectors of a model: 100 Gaussian clusters, queries drawn from the same clusters
+ */
+void runApproximate(size_t n, size_t queryNum, mt19937_64 &engine) {
+    const size_t count = 10;
+    uniform_real_distribution<float> center(0, 1000);
+    normal_distribution<float> noise(0, 150);
+    vector<HighPoint> centers(100);
+    for (auto &c : centers) for (auto &x : c) x = center(engine);
+    auto sample = [&] {
+        HighPoint point = centers[engine() % centers.size()];
+        for (auto &x : point) x += noise(engine);
+        return point;
+    };
+
+    vector<pair<HighPoint, int>> points;
+    vector<pair<HighKey, int>> tuplePoints;
+    for (size_t i = 0; i < n; i++) {
+        points.emplace_back(sample(), (int) i);
+        tuplePoints.emplace_back(apply([](auto... x) { return HighKey(x...); }, points.back().first), (int) i);
+    }
+    vector<HighPoint> queries;
+    for (size_t i = 0; i < queryNum; i++) queries.push_back(sample());
+
+    KDTree<HighKey, int> pointerTree(tuplePoints);
+    BucketKDTree<float, HIGH_DIMS, int> bucketTree(points);
+    BucketKDForest<float, HIGH_DIMS, int> forest(points, 4);
+
+    // Ground truth from the exact search
+    vector<set<int>> exact;
+    for (auto &query : queries) {
+        set<int> ids;
+        for (size_t index : bucketTree.nearest(query, count)) ids.insert(bucketTree.value(index));
+        exact.push_back(ids);
+    }
+
+    cout << "== approximate 10 nearest, " << HIGH_DIMS << "-D clustered (" << n << " points, "
+         << queryNum << " queries)" << endl;
+    cout << "mode                                 us/query    recall" << endl;
+    // search(query) returns the ids of the neighbors found
+    auto report = [&](const string &mode, auto search) {
+        size_t hits = 0;
+        double latency = nanosecondsPerOp(queries.size(), [&] {
+            for (size_t i = 0; i < queries.size(); i++) {
+                for (int id : search(queries[i])) hits += exact[i].count(id);
+            }
+        });
+        cout << left << setw(34) << mode << right << setw(12) << latency / 1e3
+             << setw(9) << setprecision(3) << (double) hits / (double) max<size_t>(queries.size() * count, 1)
+             << setprecision(1) << endl;
+    };
+    for (double epsilon : {0.0, 0.5, 1.0, 2.0}) {
+        report("KDTree epsilon " + to_string(epsilon).substr(0, 3), [&](const HighPoint &query) {
+            vector<int> ids;
+            auto key = apply([](auto... x) { return HighKey(x...); }, query);
+            for (auto &it : pointerTree.nearest(key, count, epsilon)) ids.push_back(it->second);
+            return ids;
+        });
+    }
+    for (double epsilon : {0.0, 0.5, 1.0, 2.0}) {
+        report("BucketKDTree epsilon " + to_string(epsilon).substr(0, 3), [&](const HighPoint &query) {
+            vector<int> ids;
+            for (size_t index : bucketTree.approximateNearest(query, count, epsilon)) ids.push_back(bucketTree.value(index));
+            return ids;
+        });
+    }
+    for (size_t leaves : {4, 16, 64, 256}) {
+        report("BucketKDTree " + to_string(leaves) + " leaves", [&](const HighPoint &query) {
+            vector<int> ids;
+            for (size_t index : bucketTree.approximateNearest(query, count, 0, leaves)) ids.push_back(bucketTree.value(index));
+            return ids;
+        });
+    }
+    for (size_t leaves : {4, 16, 64, 256}) {
+        report("BucketKDForest (4 trees) " + to_string(leaves) + " leaves", [&](const HighPoint &query) {
+            vector<int> ids;
+            for (size_t index : forest.approximateNearest(query, count, 0, leaves)) ids.push_back(forest.value(index));
+            return ids;
+        });
+    }
+    cout << endl;
+}
+
+int main(int argc, char const *argv[]) {
+    size_t n = argc > 1 ? (size_t) atoll(argv[1]) : 1000000;
+    size_t queryNum = argc > 2 ? (size_t) atoll(argv[2]) : 100000;
+    size_t maxThreads = argc > 3 ? (size_t) atoll(argv[3]) : thread::hardware_concurrency();
+    maxThreads = max<size_t>(maxThreads, 1);
+    mt19937_64 engine(281);
+    uniform_int_distribution<int> coordinate(0, COORDINATE_RANGE - 1);
+    cout << fixed << setprecision(1);
+#ifdef KDTREE_BOUNDING_BOX
+    cout << "KDTree bounding boxes: on" << endl << endl;
+#else
+    cout << "KDTree bounding boxes: off" << endl << endl;
+#endif
+
+    // Uniform: random points, about 100 points in each range query
+    Workload uniform;
+    uniform.name = "uniform";
+    for (size_t i = 0; i < n; i++) {
+        uniform.points.emplace_back(Key(coordinate(engine), coordinate(engine), coordinate(engine)), 1);
+    }
+    for (size_t i = 0; i < queryNum; i++) {
+        if (n > 0) uniform.lookups.push_back(uniform.points[engine() % n].first);
+        uniform.queries.emplace_back(coordinate(engine), coordinate(engine), coordinate(engine));
+        uniform.inserts.emplace_back(coordinate(engine), coordinate(engine), coordinate(engine));
+    }
+    uniform.boxSide = (int) (COORDINATE_RANGE * cbrt(100.0 / (double) max<size_t>(n, 1)));
+    runWorkload(uniform, maxThreads);
+
+    // Clustered: 100 Gaussian clusters, the queries are drawn from the same clusters
+    Workload clustered;
+    clustered.name = "clustered";
+    vector<Key> centers;
+    for (size_t i = 0; i < 100; i++) centers.emplace_back(coordinate(engine), coordinate(engine), coordinate(engine));
+    normal_distribution<double> noise(0, COORDINATE_RANGE / 100.0);
+    auto clusterPoint = [&] {
+        const Key &center = centers[engine() % centers.size()];
+        auto offset = [&](int x) {
+            return min(max((int) lround(x + noise(engine)), 0), COORDINATE_RANGE - 1);
+        };
+        return Key(offset(get<0>(center)), offset(get<1>(center)), offset(get<2>(center)));
+    };
+    for (size_t i = 0; i < n; i++) clustered.points.emplace_back(clusterPoint(), 1);
+    for (size_t i = 0; i < queryNum; i++) {
+        if (n > 0) clustered.lookups.push_back(clustered.points[engine() % n].first);
+        clustered.queries.push_back(clusterPoint());
+    }
+    clustered.boxSide = uniform.boxSide / 10;
+
+    // Sorted: the uniform points in increasing order, the worst order for inserting one by one
+    Workload sorted = uniform;
+    sorted.name = "sorted";
+    sort(sorted.points.begin(), sorted.points.end());
+
+    // Tied: random x, constant y and z in {0, ..., 3}, so most splits on y and z are ties,
+    // which all go right and keep those subtrees unbalanced after a rebuild
+    Workload tied;
+    tied.name = "tied";
+    for (size_t i = 0; i < n; i++) tied.points.emplace_back(Key(coordinate(engine), 0, (int) (engine() % 4)), 1);
+    for (size_t i = 0; i < queryNum; i++) {
+        if (n > 0) tied.lookups.push_back(tied.points[engine() % n].first);
+        tied.queries.emplace_back(coordinate(engine), 0, (int) (engine() % 4));
+    }
+    tied.boxSide = (int) (COORDINATE_RANGE * 100.0 / (double) max<size_t>(n, 1));
+    Workload tiedSorted = tied;
+    tiedSorted.name = "tied sorted";
+    sort(tiedSorted.points.begin(), tiedSorted.points.end());
+
+    profileWorkload(uniform, false);
+    profileWorkload(clustered, false);
+    profileWorkload(sorted, false);
+    profileWorkload(sorted, true);
+    profileWorkload(tied, true);
+    profileWorkload(tiedSorted, true);
+
+    runApproximate(max<size_t>(n / 10, 1), max<size_t>(queryNum / 100, 1), engine);
+
+    return 0;
+}
@@ -0,0 +1,567 @@
+#ifndef VE281P3_STATIC_KDTREE_HPP
+#define VE281P3_STATIC_KDTREE_HPP
+
+#include "kdtree.hpp"
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * An abstract template base of the StaticKDTree class
+ */
+template<typename...>
+class StaticKDTree;
+
+/**
+ * A read-only KDTree built once into a contiguous, pointer-free layout
+ * The nodes are stored in BFS order of a left-balanced complete binary tree:
+ * the children of node i are 2i + 1 and 2i + 2, so n nodes use exactly the indices [0, n).
+ * The keys are stored as a structure of arrays (one vector per dimension), and a node is
+ * referred to by its index.
+ * A tree can be saved to a file in the same layout, and mapped back read-only with mmap:
+ * the queries run on the mapped arrays directly, so processes mapping the same file share
+ * one copy of it in the page cache.
+ * The node at depth h splits on dimension h % k. Its left subtree holds the keys less than it
+ * and its right subtree holds the keys greater than it, both compared with compareKey
+ * (the dimension first, then the whole key), so ties on the dimension may be on both sides.
+ * The time complexity of functions are based on n and k
+ * n is the size of the tree
+ * k is the number of dimensions
+ * @typedef Key         key type
+ * @typedef Value       value type
+ * @static  KeySize     k (number of dimensions)
+ * @static  npos        index returned when no node is found
+ */
+template<typename ValueType, typename... KeyTypes>
+class StaticKDTree<std::tuple<KeyTypes...>, ValueType> {
+public:
+    typedef std::tuple<KeyTypes...> Key;
+    typedef ValueType Value;
+    static inline constexpr size_t KeySize = std::tuple_size<Key>::value;
+    static inline constexpr size_t npos = ~size_t(0);
+    static_assert(KeySize > 0, "Can not construct StaticKDTree with zero dimension");
+
+protected:
+    std::tuple<std::vector<KeyTypes>...> keyStorage;    // arrays of a tree built in memory, empty if mapped
+    std::vector<Value> valueStorage;
+    std::shared_ptr<const char> mapping;                // the mapped file, shared by copies of the tree
+    size_t mappingSize = 0;
+
+    std::tuple<const KeyTypes *...> keys{};             // std::get<d>(keys)[i] is dimension d of node i
+    const Value *values = nullptr;
+    size_t treeSize = 0;
+
+    typedef std::priority_queue<std::pair<double, size_t>> NeighborHeap;
+
+    static constexpr char FILE_MAGIC[8] = {'V', 'E', '2', '8', '1', 'K', 'D', 'T'};
+    static constexpr uint32_t FILE_VERSION = 1;
+    static constexpr size_t FILE_ALIGNMENT = 64;        // arrays in a file start at multiples of a cache line
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t dims;                                  // k
+        uint64_t size;                                  // n
+        uint32_t elementSizes[KeySize + 1];             // sizes of the key types and the value type
+    };
+
+    /**
+     * Offsets of the arrays in a file: the header, then the array of each dimension and the values,
+     * each aligned to FILE_ALIGNMENT
+     * Time Complexity: O(k)
+     * @param n size of the tree
+     * @return offsets of the k key arrays and the values, and the size of the file
+     */
+    static std::array<size_t, KeySize + 2> fileLayout(size_t n) {
+        constexpr size_t sizes[] = {sizeof(KeyTypes)..., sizeof(Value)};
+        std::array<size_t, KeySize + 2> offsets{};
+        size_t offset = sizeof(FileHeader);
+        for (size_t i = 0; i <= KeySize; i++) {
+            offset = (offset + FILE_ALIGNMENT - 1) / FILE_ALIGNMENT * FILE_ALIGNMENT;
+            offsets[i] = offset;
+            offset += sizes[i] * n;
+        }
+        offsets[KeySize + 1] = offset;
+        return offsets;
+    }
+
+    /**
+     * Point the arrays to the storage of a tree built in memory
+     */
+    void useStorage() {
+        std::apply([&](const auto &...dims) { keys = std::make_tuple(dims.data()...); }, keyStorage);
+        values = valueStorage.data();
+    }
+
+    /**
+     * Point the arrays into a file laid out by fileLayout
+     */
+    template<size_t... DIMS>
+    void useFile(const char *base, const std::array<size_t, KeySize + 2> &offsets, std::index_sequence<DIMS...>) {
+        ((std::get<DIMS>(keys) = reinterpret_cast<const std::tuple_element_t<DIMS, Key> *>(base + offsets[DIMS])), ...);
+        values = reinterpret_cast<const Value *>(base + offsets[KeySize]);
+    }
+
+    /**
+     * @return the key-value pairs of a KDTree
+     */
+    static std::vector<std::pair<Key, Value>> items(KDTree<Key, Value> &tree) {
+        std::vector<std::pair<Key, Value>> result;
+        result.reserve(tree.size());
+        tree.forEach([&](const std::pair<const Key, Value> &data) { result.emplace_back(data.first, data.second); });
+        return result;
+    }
+
+    template<size_t DIM>
+    const auto &at(size_t index) const {
+        return std::get<DIM>(keys)[index];
+    }
+
+    template<size_t... DIMS>
+    Key key(size_t index, std::index_sequence<DIMS...>) const {
+        return Key(at<DIMS>(index)...);
+    }
+
+    template<size_t... DIMS>
+    void store(size_t index, Key &&key, std::index_sequence<DIMS...>) {
+        ((std::get<DIMS>(keyStorage)[index] = std::move(std::get<DIMS>(key))), ...);
+    }
+
+    /**
+     * @param n
+     * @return number of nodes in the left subtree of a left-balanced complete tree with n nodes
+     */
+    static size_t leftSize(size_t n) {
+        if (n <= 1) return 0;
+        size_t height = 0;
+        while ((size_t(2) << height) <= n) height++;
+        size_t last = n - ((size_t(1) << height) - 1);      // nodes on the last level
+        size_t half = size_t(1) << (height - 1);            // capacity of the last level of each subtree
+        return half - 1 + std::min(last, half);
+    }
+
+    /**
+     * Build the subtree rooted at index from items[begin, end)
+     * Time Complexity: O(kn log n)
+     * @tparam DIM dimension of the node
+     */
+    template<size_t DIM>
+    void build(std::vector<std::pair<Key, Value>> &items, size_t begin, size_t end, size_t index) {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (begin >= end) return;
+        size_t mid = begin + leftSize(end - begin);
+        std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+                         [](const std::pair<Key, Value> &a, const std::pair<Key, Value> &b) {
+                             return lessKey<DIM>(a.first, b.first);
+                         });
+        store(index, std::move(items[mid].first), std::index_sequence_for<KeyTypes...>());
+        valueStorage[index] = std::move(items[mid].second);
+        build<DIM_NEXT>(items, begin, mid, 2 * index + 1);
+        build<DIM_NEXT>(items, mid + 1, end, 2 * index + 2);
+    }
+
+    /**
+     * Time Complexity: O(k)
+     * @return whether a is less than b on DIM, ties are broken by the whole key
+     */
+    template<size_t DIM>
+    static bool lessKey(const Key &a, const Key &b) {
+        if (std::get<DIM>(a) != std::get<DIM>(b)) return std::get<DIM>(a) < std::get<DIM>(b);
+        return a < b;
+    }
+
+    /**
+     * Time Complexity: O(k)
+     * @return whether key is less than node index on DIM, ties are broken by the whole key
+     */
+    template<size_t DIM>
+    bool lessThanNode(const Key &key, size_t index) const {
+        if (std::get<DIM>(key) != at<DIM>(index)) return std::get<DIM>(key) < at<DIM>(index);
+        return key < this->key(index, std::index_sequence_for<KeyTypes...>());
+    }
+
+    template<size_t DIM = 0>
+    bool equalsNode(const Key &key, size_t index) const {
+        if (!(std::get<DIM>(key) == at<DIM>(index))) return false;
+        if constexpr (DIM + 1 < KeySize) return equalsNode<DIM + 1>(key, index);
+        else return true;
+    }
+
+    template<size_t DIM = 0>
+    bool inBox(size_t index, const Key &lo, const Key &hi) const {
+        if (at<DIM>(index) < std::get<DIM>(lo) || std::get<DIM>(hi) < at<DIM>(index)) return false;
+        if constexpr (DIM + 1 < KeySize) return inBox<DIM + 1>(index, lo, hi);
+        else return true;
+    }
+
+    template<typename Metric, size_t DIM = 0>
+    double distance(const Key &key, size_t index, double total = 0) const {
+        total = Metric::combine(total, Metric::axis(double(std::get<DIM>(key)) - double(at<DIM>(index))));
+        if constexpr (DIM + 1 < KeySize) return distance<Metric, DIM + 1>(key, index, total);
+        else return total;
+    }
+
+    template<typename Metric>
+    static double boxDistance(const std::array<double, KeySize> &offsets) {
+        double total = 0;
+        for (double offset : offsets) total = Metric::combine(total, Metric::axis(offset));
+        return total;
+    }
+
+    /**
+     * Find the node with key in a subtree
+     * Time Complexity: O(k log n)
+     * @tparam DIM current dimension of node
+     */
+    template<size_t DIM>
+    size_t find(const Key &key, size_t index) const {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (index >= treeSize) return npos;
+        if (equalsNode(key, index)) return index;
+        return find<DIM_NEXT>(key, lessThanNode<DIM>(key, index) ? 2 * index + 1 : 2 * index + 2);
+    }
+
+    /**
+     * @return the node with the smaller (MIN) or greater key on DIM_CMP, npos loses to any node
+     */
+    template<size_t DIM_CMP, bool MIN>
+    size_t pick(size_t a, size_t b) const {
+        if (a == npos) return b;
+        if (b == npos) return a;
+        Key keyA = key(a, std::index_sequence_for<KeyTypes...>());
+        Key keyB = key(b, std::index_sequence_for<KeyTypes...>());
+        return lessKey<DIM_CMP>(keyA, keyB) == MIN ? a : b;
+    }
+
+    /**
+     * Find the minimum (MIN) or maximum node on a dimension in a subtree
+     * Time Complexity: O(n^(1-1/k))
+     * @tparam DIM_CMP comparison dimension
+     * @tparam DIM current dimension of node
+     * @tparam MIN
+     */
+    template<size_t DIM_CMP, size_t DIM, bool MIN>
+    size_t findExtreme(size_t index) const {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (index >= treeSize) return npos;
+        size_t best = findExtreme<DIM_CMP, DIM_NEXT, MIN>(MIN ? 2 * index + 1 : 2 * index + 2);
+        if (DIM_CMP != DIM) best = pick<DIM_CMP, MIN>(best, findExtreme<DIM_CMP, DIM_NEXT, MIN>(MIN ? 2 * index + 2 : 2 * index + 1));
+        return pick<DIM_CMP, MIN>(best, index);
+    }
+
+    template<size_t DIM, bool MIN>
+    size_t findExtremeDynamic(size_t dim) const {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (dim >= KeySize) dim %= KeySize;
+        if (dim == DIM) return findExtreme<DIM, 0, MIN>(0);
+        return findExtremeDynamic<DIM_NEXT, MIN>(dim);
+    }
+
+    template<size_t DIM, typename Visitor>
+    void range(size_t index, const Key &lo, const Key &hi, Visitor &visit) const {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (index >= treeSize) return;
+        const auto &split = at<DIM>(index);
+        // The left subtree is not greater than split on DIM, the right subtree is not less
+        if (!(split < std::get<DIM>(lo))) range<DIM_NEXT>(2 * index + 1, lo, hi, visit);
+        if (inBox(index, lo, hi)) visit(index);
+        if (!(std::get<DIM>(hi) < split)) range<DIM_NEXT>(2 * index + 2, lo, hi, visit);
+    }
+
+    template<typename Metric, size_t DIM>
+    void nearest(size_t index, const Key &key, size_t count, NeighborHeap &heap,
+                 std::array<double, KeySize> &offsets) const {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (index >= treeSize) return;
+
+        double dist = distance<Metric>(key, index);
+        if (heap.size() < count) heap.emplace(dist, index);
+        else if (dist < heap.top().first) {
+            heap.pop();
+            heap.emplace(dist, index);
+        }
+
+        double diff = double(std::get<DIM>(key)) - double(at<DIM>(index));
+        size_t nearChild = diff < 0 ? 2 * index + 1 : 2 * index + 2;
+        size_t farChild = diff < 0 ? 2 * index + 2 : 2 * index + 1;
+        nearest<Metric, DIM_NEXT>(nearChild, key, count, heap, offsets);
+
+        double offset = offsets[DIM];
+        offsets[DIM] = diff;
+        if (farChild < treeSize && (heap.size() < count || boxDistance<Metric>(offsets) < heap.top().first)) {
+            nearest<Metric, DIM_NEXT>(farChild, key, count, heap, offsets);
+        }
+        offsets[DIM] = offset;
+    }
+
+public:
+    StaticKDTree() = default;
+
+    /**
+     * Build the tree, if a key appears more than once, the last value is kept
+     * Time complexity: O(kn log n)
+     * @param v we pass by value here because v need to be modified
+     */
+    explicit StaticKDTree(std::vector<std::pair<Key, Value>> v) {
+        std::stable_sort(v.begin(), v.end(), [](const std::pair<Key, Value> &a, const std::pair<Key, Value> &b) {
+            return a.first < b.first;
+        });
+        size_t unique = 0;
+        for (size_t i = 0; i < v.size(); i++) {
+            if (i + 1 < v.size() && v[i].first == v[i + 1].first) continue;
+            if (unique != i) v[unique] = std::move(v[i]);
+            unique++;
+        }
+        v.resize(unique);
+
+        treeSize = v.size();
+        std::apply([&](auto &...dims) { (dims.resize(treeSize), ...); }, keyStorage);
+        valueStorage.resize(treeSize);
+        build<0>(v, 0, v.size(), 0);
+        useStorage();
+    }
+
+    /**
+     * Build a read-only copy of a KDTree
+     * Time complexity: O(kn log n)
+     * @param tree
+     */
+    explicit StaticKDTree(KDTree<Key, Value> &tree) : StaticKDTree(items(tree)) {}
+
+    /**
+     * Time complexity: O(n), O(1) for a mapped tree, which shares the mapping
+     */
+    StaticKDTree(const StaticKDTree &that)
+            : keyStorage(that.keyStorage), valueStorage(that.valueStorage), mapping(that.mapping),
+              mappingSize(that.mappingSize), keys(that.keys), values(that.values), treeSize(that.treeSize) {
+        if (!mapping) useStorage();
+    }
+
+    StaticKDTree(StaticKDTree &&) noexcept = default;
+
+    StaticKDTree &operator=(StaticKDTree that) noexcept {
+        std::swap(keyStorage, that.keyStorage);
+        std::swap(valueStorage, that.valueStorage);
+        std::swap(mapping, that.mapping);
+        std::swap(mappingSize, that.mappingSize);
+        std::swap(keys, that.keys);
+        std::swap(values, that.values);
+        std::swap(treeSize, that.treeSize);
+        return *this;
+    }
+
+    /**
+     * Save the tree to a file, in the byte order and type sizes of this machine
+     * Time complexity: O(n)
+     * @param path
+     * @throw std::runtime_error if the file can not be written
+     */
+    void save(const std::string &path) const {
+        static_assert(std::conjunction<std::is_trivially_copyable<KeyTypes>..., std::is_trivially_copyable<Value>>::value,
+                      "Only trees with trivially copyable keys and values can be saved");
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) throw std::runtime_error("can not open " + path);
+
+        FileHeader header{};
+        std::memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+        header.version = FILE_VERSION;
+        header.dims = (uint32_t) KeySize;
+        header.size = treeSize;
+        size_t i = 0;
+        for (size_t size : {sizeof(KeyTypes)..., sizeof(Value)}) header.elementSizes[i++] = (uint32_t) size;
+
+        auto offsets = fileLayout(treeSize);
+        size_t written = 0;
+        auto write = [&](const void *data, size_t offset, size_t bytes) {
+            static const char padding[FILE_ALIGNMENT] = {};
+            out.write(padding, (std::streamsize) (offset - written));
+            out.write(static_cast<const char *>(data), (std::streamsize) bytes);
+            written = offset + bytes;
+        };
+        write(&header, 0, sizeof(header));
+        i = 0;
+        std::apply([&](const auto *...dims) {
+            ((write(dims, offsets[i], sizeof(*dims) * treeSize), i++), ...);
+        }, keys);
+        write(values, offsets[KeySize], sizeof(Value) * treeSize);
+        out.flush();
+        if (!out) throw std::runtime_error("can not write " + path);
+    }
+
+    /**
+     * Map a file written by save as a read-only tree, nothing is copied or deserialized
+     * The file is mapped with mmap where available (and read into memory elsewhere),
+     * it must not be changed while the tree or its copies are alive
+     * Time complexity: O(k)
+     * @param path
+     * @return the mapped tree
+     * @throw std::runtime_error if the file can not be mapped, or was not saved by a StaticKDTree of this type
+     */
+    static StaticKDTree map(const std::string &path) {
+        static_assert(std::conjunction<std::is_trivially_copyable<KeyTypes>..., std::is_trivially_copyable<Value>>::value,
+                      "Only trees with trivially copyable keys and values can be mapped");
+        StaticKDTree tree;
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("can not open " + path);
+        struct stat status{};
+        if (::fstat(fd, &status) != 0 || status.st_size == 0) {
+            ::close(fd);
+            throw std::runtime_error("can not map " + path);
+        }
+        size_t length = (size_t) status.st_size;
+        void *address = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED) throw std::runtime_error("can not map " + path);
+        tree.mapping = std::shared_ptr<const char>(static_cast<const char *>(address), [length](const char *data) {
+            ::munmap(const_cast<char *>(data), length);
+        });
+#else
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) throw std::runtime_error("can not open " + path);
+        size_t length = (size_t) in.tellg();
+        std::shared_ptr<char> buffer(new char[length], std::default_delete<char[]>());
+        in.seekg(0);
+        if (!in.read(buffer.get(), (std::streamsize) length)) throw std::runtime_error("can not read " + path);
+        tree.mapping = buffer;
+#endif
+        tree.mappingSize = length;
+
+        FileHeader header{};
+        if (length < sizeof(header)) throw std::runtime_error(path + " is not a StaticKDTree file");
+        std::memcpy(&header, tree.mapping.get(), sizeof(header));
+        size_t i = 0;
+        bool typesMatch = header.dims == KeySize;
+        for (size_t size : {sizeof(KeyTypes)..., sizeof(Value)}) typesMatch = typesMatch && header.elementSizes[i++] == size;
+        if (std::memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 || header.version != FILE_VERSION) {
+            throw std::runtime_error(path + " is not a StaticKDTree file");
+        }
+        if (!typesMatch) throw std::runtime_error(path + " holds a StaticKDTree of another type");
+        // Check the size before the layout, so that a corrupt size can not overflow the offsets
+        constexpr size_t elementBytes = (sizeof(KeyTypes) + ... + sizeof(Value));
+        if (header.size > length / elementBytes) throw std::runtime_error(path + " is truncated");
+        auto offsets = fileLayout(header.size);
+        if (length < offsets[KeySize + 1]) throw std::runtime_error(path + " is truncated");
+
+        tree.treeSize = header.size;
+        tree.useFile(tree.mapping.get(), offsets, std::index_sequence_for<KeyTypes...>());
+        return tree;
+    }
+
+    /**
+     * Time Complexity: O(k)
+     * @param index
+     * @return key of the node
+     */
+    Key key(size_t index) const {
+        return key(index, std::index_sequence_for<KeyTypes...>());
+    }
+
+    /**
+     * Time Complexity: O(1)
+     * @param index
+     * @return value of the node
+     */
+    const Value &value(size_t index) const {
+        return values[index];
+    }
+
+    /**
+     * Time Complexity: O(k log n)
+     * @param key
+     * @return index of the node with key, or npos if not found
+     */
+    size_t find(const Key &key) const {
+        return find<0>(key, 0);
+    }
+
+    template<size_t DIM>
+    size_t findMin() const {
+        return findExtreme<DIM, 0, true>(0);
+    }
+
+    size_t findMin(size_t dim) const {
+        return findExtremeDynamic<0, true>(dim);
+    }
+
+    template<size_t DIM>
+    size_t findMax() const {
+        return findExtreme<DIM, 0, false>(0);
+    }
+
+    size_t findMax(size_t dim) const {
+        return findExtremeDynamic<0, false>(dim);
+    }
+
+    /**
+     * Visit the nodes inside the box [lo, hi] (inclusive on every dimension)
+     * Time Complexity: O(k n^(1-1/k) + km) for well-distributed keys, m is the number of results
+     * @param lo
+     * @param hi
+     * @param visit function object, called with the index of each node inside the box
+     */
+    template<typename Visitor>
+    void range(const Key &lo, const Key &hi, Visitor visit) const {
+        range<0>(0, lo, hi, visit);
+    }
+
+    /**
+     * Find the k nearest neighbors of a key
+     * Time Complexity: O(k log n + count log count) on average for well-distributed keys
+     * @tparam Metric L2Metric, L1Metric, LinfMetric or a user-defined metric with the same interface
+     * @param key
+     * @param count number of neighbors
+     * @return indices of at most count nodes, from the nearest to the farthest
+     */
+    template<typename Metric = L2Metric>
+    std::vector<size_t> nearest(const Key &key, size_t count) const {
+        std::vector<size_t> result;
+        if (count == 0) return result;
+        NeighborHeap heap;
+        std::array<double, KeySize> offsets{};
+        nearest<Metric, 0>(0, key, count, heap, offsets);
+        result.resize(heap.size());
+        for (size_t i = result.size(); i > 0; i--) {
+            result[i - 1] = heap.top().second;
+            heap.pop();
+        }
+        return result;
+    }
+
+    /**
+     * @return number of bytes used by the keys and values (excluding memory owned by them),
+     * or of the file for a mapped tree
+     */
+    size_t memoryUsage() const {
+        size_t bytes = valueStorage.capacity() * sizeof(Value) + mappingSize;
+        std::apply([&](const auto &...dims) {
+            ((bytes += dims.capacity() * sizeof(typename std::decay_t<decltype(dims)>::value_type)), ...);
+        }, keyStorage);
+        return bytes;
+    }
+
+    /**
+     * @return whether the tree is mapped from a file
+     */
+    bool mapped() const { return (bool) mapping; }
+
+    size_t size() const { return treeSize; }
+};
+
+#endif //VE281P3_STATIC_KDTREE_HPP
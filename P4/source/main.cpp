@@ -1,6 +1,9 @@
 #include <bits/stdc++.h>
 #include <string>
 #include <queue>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace std;
 const int INF = 1000000000;
 
@@ -9,84 +12,166 @@ const int INF = 1000000000;
 // Second item store the node's index
 typedef pair<int, int> iPair; 
 
-class Graph{
+// The whole standard input, mapped into memory if it is a regular file
+// and read into a buffer otherwise (e.g. a pipe)
+class Input{
 private:
-    int nodeNum;
-
-    class Edge{
-    public:
-        int weight;
-        int start_index;
-        int end_index;
-        Edge *next;
+    const char* data;
+    size_t length;
+    size_t pos;
+    void* mapped;
+    vector<char> buffer;
 
-        Edge(int weight, int start, int end): weight(weight), start_index(start), end_index(end), next(nullptr) {}        
-    };
-
-    class Node{
-    public:
-        Edge* headEdge;
-        int index;
-        bool visited;
-        Node(Edge* headEdge = nullptr, int ID = -1):
-        headEdge(headEdge), index(ID), visited(false) {}
-    };
+public:
+    Input(): data(nullptr), length(0), pos(0), mapped(nullptr){
+        struct stat info;
+        if(fstat(STDIN_FILENO, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0){
+            length = (size_t) info.st_size;
+            mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+            if(mapped == MAP_FAILED) mapped = nullptr;
+            else{
+                madvise(mapped, length, MADV_SEQUENTIAL);
+                data = (const char*) mapped;
+                // Start where the stdin file offset is, like cin would
+                off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+                if(offset > 0) pos = min((size_t) offset, length);
+                return;
+            }
+        }
+        char chunk[1 << 16];
+        ssize_t n;
+        while((n = read(STDIN_FILENO, chunk, sizeof(chunk))) > 0) buffer.insert(buffer.end(), chunk, chunk + n);
+        data = buffer.data();
+        length = buffer.size();
+    }
 
-    Node* nodes;
+    ~Input(){
+        if(mapped) munmap(mapped, length);
+    }
 
-public:
-    Graph(int node_num){
-        nodeNum = node_num;
-        nodes = new Node[node_num];
+    Input(const Input&) = delete;
+    Input& operator=(const Input&) = delete;
+
+    size_t position() const { return pos; }
+    void seek(size_t position){ pos = position; }
+
+    // Parse the next integer, skipping anything before it
+    // Return false at the end of the input
+    bool nextInt(int& value){
+        while(pos < length && data[pos] != '-' && (data[pos] < '0' || data[pos] > '9')) pos++;
+        if(pos == length) return false;
+        bool negative = data[pos] == '-';
+        if(negative) pos++;
+        int result = 0;
+        while(pos < length && data[pos] >= '0' && data[pos] <= '9') result = result * 10 + (data[pos++] - '0');
+        value = negative ? -result : result;
+        return true;
     }
+};
 
-    ~Graph(){
+class Graph{
+private:
+    int nodeNum;
+
+    // Compressed sparse row storage: the edges leaving node i are
+    // targets[offsets[i]] ... targets[offsets[i + 1] - 1], with the same weights,
+    // in the order they appear in the input
+    vector<size_t> offsets;
+    vector<int> targets;
+    vector<int> weights;
+
+    // The same edges grouped by their end node, built on first use by MST_Prim:
+    // the edges entering node i come from sources[reverseOffsets[i]] ... sources[reverseOffsets[i + 1] - 1]
+    vector<size_t> reverseOffsets;
+    vector<int> sources;
+    vector<int> reverseWeights;
+
+    // Counting sort of the edges by end node, O(V + E)
+    void buildReverse(){
+        if(!reverseOffsets.empty()) return;
+        reverseOffsets.assign(nodeNum + 1, 0);
+        for(size_t e = 0; e < targets.size(); e++) reverseOffsets[targets[e] + 1]++;
+        for(int i = 0; i < nodeNum; i++) reverseOffsets[i + 1] += reverseOffsets[i];
+
+        sources.resize(targets.size());
+        reverseWeights.resize(targets.size());
+        vector<size_t> next(reverseOffsets.begin(), reverseOffsets.end() - 1);
         for(int i = 0; i < nodeNum; i++){
-            Edge* q = nullptr;
-            Edge* p = nodes[i].headEdge;
-            while(p){
-                q = p->next;
-                delete p;
-                p = q;
+            for(size_t e = offsets[i]; e < offsets[i + 1]; e++){
+                size_t edge = next[targets[e]]++;
+                sources[edge] = i;
+                reverseWeights[edge] = weights[e];
             }
         }
-        delete[] nodes;
     }
 
-    void readGraph(){
-        // Set index of nodes
-        for(int i = 0; i < nodeNum; i++) nodes[i].index = i;
-
-        // Read the file
-        stringstream ss;
-        while(!cin.eof()){
-            string line;
-            getline(cin, line);
-            if(line.empty()) continue;
-            ss.clear();
-            ss.str(line);
-            int start_node, end_node, weight;
-            ss >> start_node >> end_node >> weight;
-
-            if(!nodes[start_node].headEdge) nodes[start_node].headEdge = new Edge(weight, start_node, end_node);
-            else{
-                Edge** temp = &nodes[start_node].headEdge;
-                while((*temp)->next) temp = &((*temp)->next);
-                (*temp)->next = new Edge(weight, start_node, end_node);
+    // Union-find with path halving and union by size, for MST_Kruskal
+    class DisjointSet{
+    private:
+        vector<int> parent;
+        vector<int> size;
+
+    public:
+        DisjointSet(int n): parent(n), size(n, 1){
+            for(int i = 0; i < n; i++) parent[i] = i;
+        }
+
+        int find(int x){
+            while(parent[x] != x){
+                parent[x] = parent[parent[x]];
+                x = parent[x];
             }
+            return x;
+        }
+
+        // Return false if x and y are already in the same set
+        bool unite(int x, int y){
+            x = find(x);
+            y = find(y);
+            if(x == y) return false;
+            if(size[x] < size[y]) swap(x, y);
+            parent[y] = x;
+            size[x] += size[y];
+            return true;
+        }
+    };
+
+    void printMST(long long total_weight, bool connected){
+        if(!connected) cout << "No MST exists!" << endl;
+        else cout << "The total weight of MST is " << total_weight << endl;
+    }
+
+public:
+    Graph(int node_num): nodeNum(node_num), offsets(node_num + 1, 0) {}
+
+    // Read the edges "start end weight" till the end of input
+    // The first pass counts the out degree of every node, the second pass
+    // puts each edge at its place, so no edge list is kept in between
+    void readGraph(Input& input){
+        size_t begin = input.position();
+        int start_node, end_node, weight;
+        while(input.nextInt(start_node) && input.nextInt(end_node) && input.nextInt(weight)){
+            offsets[start_node + 1]++;
+        }
+        for(int i = 0; i < nodeNum; i++) offsets[i + 1] += offsets[i];
+
+        targets.resize(offsets[nodeNum]);
+        weights.resize(offsets[nodeNum]);
+        vector<size_t> next(offsets.begin(), offsets.end() - 1);
+        input.seek(begin);
+        while(input.nextInt(start_node) && input.nextInt(end_node) && input.nextInt(weight)){
+            size_t edge = next[start_node]++;
+            targets[edge] = end_node;
+            weights[edge] = weight;
         }
     }
 
     void print_helper(int source_node, int end_node){
         cout << source_node << " " << end_node << " " << nodeNum << endl;
         for(int i = 0; i < nodeNum; i++){
-            Edge** temp = &nodes[i].headEdge;
-            if(!nodes[i].headEdge) continue;
-
-            while(*temp){
-                cout << (*temp)->start_index << " " << (*temp)->end_index << " " << (*temp)->weight << endl;
-                temp = &((*temp)->next);
-            } 
+            for(size_t e = offsets[i]; e < offsets[i + 1]; e++){
+                cout << i << " " << targets[e] << " " << weights[e] << endl;
+            }
         }
     }
 
@@ -107,21 +192,15 @@ public:
             q.pop();
             
             // scan all adjacent vertex of current node
-            if(!nodes[u].headEdge) continue;
-            else{
-                Edge* temp = nodes[u].headEdge;
-                while(temp){
-                    int v = temp->end_index;
-                    int w = temp->weight;
-
-                    // If there is shorter path to v through u. 
-                    if(dist[v] > dist[u] + w){
-                        // Updating distance of v 
-                        dist[v] = dist[u] + w;
-                        q.push(make_pair(dist[v], v));
-                    }
-
-                    temp = temp->next;
+            for(size_t e = offsets[u]; e < offsets[u + 1]; e++){
+                int v = targets[e];
+                int w = weights[e];
+
+                // If there is shorter path to v through u. 
+                if(dist[v] > dist[u] + w){
+                    // Updating distance of v 
+                    dist[v] = dist[u] + w;
+                    q.push(make_pair(dist[v], v));
                 }
             }
         }
@@ -136,16 +215,7 @@ public:
         int* indegree = new int[nodeNum];
         for(int i = 0; i < nodeNum; i++) indegree[i] = 0;
         
-        for(int i = 0; i < nodeNum; i++){
-            if(!nodes[i].headEdge) continue;
-            else{
-                Edge* temp = nodes[i].headEdge;
-                while(temp){
-                    indegree[temp->end_index]++;
-                    temp = temp->next;
-                }
-            }
-        }
+        for(size_t e = 0; e < targets.size(); e++) indegree[targets[e]]++;
 
         queue<int> Q;
         int count = 0;
@@ -160,15 +230,9 @@ public:
             Q.pop();
             count++;
 
-            if(!nodes[u].headEdge) continue;
-            else{
-                Edge* temp = nodes[u].headEdge;
-                while(temp){
-                    int v = temp->end_index;
-                    if(--indegree[v] == 0) Q.push(v);
-                    // Check next edge
-                    temp = temp->next;
-                }
+            for(size_t e = offsets[u]; e < offsets[u + 1]; e++){
+                int v = targets[e];
+                if(--indegree[v] == 0) Q.push(v);
             }
         }
 
@@ -178,72 +242,86 @@ public:
         delete[] indegree;
     }
 
+    // The edges are taken as undirected
+    // Kruskal sorts the edges once and is faster on sparse graphs,
+    // Prim only keeps a heap of the frontier and is faster on dense ones
     void MST(){
+        if(targets.size() <= 32 * (size_t) nodeNum) MST_Kruskal();
+        else MST_Prim();
+    }
+
+    // Prim's algorithm with a lazy-deletion heap, O(E log E)
+    // The neighbours of a node are its out edges in the CSR plus its in edges in the reverse CSR
+    void MST_Prim(){
+        if(nodeNum == 0) return printMST(0, true);
+        buildReverse();
         vector<int> dist(nodeNum, INF);
         vector<bool> visited(nodeNum, false);
         priority_queue<iPair, vector<iPair>, greater<iPair> > pq;
-        int total_weight = 0;
+        long long total_weight = 0;
+        int added = 0;
 
         // Initialize 
         dist[0] = 0;
         pq.push(make_pair(0,0));
 
+        auto relax = [&](int neighbour_index, int neighbour_weight){
+            if(!visited[neighbour_index] && dist[neighbour_index] > neighbour_weight){
+                dist[neighbour_index] = neighbour_weight;
+                pq.push(make_pair(neighbour_weight, neighbour_index));
+            }
+        };
+
         while(!pq.empty()){
             int cur = pq.top().second;
             pq.pop();
+            // Skip the stale entries of nodes already in the tree
+            if(visited[cur]) continue;
             visited[cur] = true;
+            total_weight += dist[cur];
+            added++;
 
             // Update all neighburs
-            vector<iPair> neighbours;     
-            Edge* temp = nodes[cur].headEdge;
-            while (temp){                                   
-                int u = temp->end_index;
-                int w = temp->weight;
-                neighbours.push_back(make_pair(u,w));
-                temp = temp->next;
-            }                   
-
-            for (int i = 0; i < nodeNum; i++){
-                if(i != cur){
-                    Edge *temp_1 = nodes[i].headEdge;
-                    while (temp_1){
-                        int p = temp_1->end_index;
-                        int r = temp_1->start_index;
-                        int q = temp_1->weight;
-                        if(p == cur) neighbours.push_back(make_pair(r,q));
-                        temp_1 = temp_1->next;
-                    }                 
-                }                                           
-            }
-
-            for (size_t i = 0; i < neighbours.size(); i++){
-                int neighbour_index = neighbours[i].first;
-                int neighbour_weight = neighbours[i].second;
-                if(!visited[neighbour_index] && dist[neighbour_index] > neighbour_weight){
-                    dist[neighbour_index] = neighbour_weight;
-                    pq.push(make_pair(dist[neighbour_index],neighbour_index));
-                }
-            }
+            for (size_t e = offsets[cur]; e < offsets[cur + 1]; e++) relax(targets[e], weights[e]);
+            for (size_t e = reverseOffsets[cur]; e < reverseOffsets[cur + 1]; e++) relax(sources[e], reverseWeights[e]);
         }
 
+        printMST(total_weight, added == nodeNum);
+    }
 
-        for (size_t i = 0; i < dist.size(); i++){
-            if(dist[i]==INF){
-                cout << "No MST exists!" << endl;
-                return;
+    // Kruskal's algorithm with a union-find, O(E log E)
+    void MST_Kruskal(){
+        vector<size_t> order(targets.size());
+        vector<int> starts(targets.size());
+        for(int i = 0; i < nodeNum; i++){
+            for(size_t e = offsets[i]; e < offsets[i + 1]; e++) starts[e] = i;
+        }
+        for(size_t e = 0; e < order.size(); e++) order[e] = e;
+        sort(order.begin(), order.end(), [&](size_t a, size_t b){ return weights[a] < weights[b]; });
+
+        DisjointSet components(nodeNum);
+        long long total_weight = 0;
+        int added = 0;
+        for(size_t i = 0; i < order.size() && added + 1 < nodeNum; i++){
+            size_t e = order[i];
+            if(components.unite(starts[e], targets[e])){
+                total_weight += weights[e];
+                added++;
             }
-            else total_weight += dist[i];
         }
 
-        cout << "The total weight of MST is " << total_weight << endl;
+        printMST(total_weight, added + 1 >= nodeNum);
     }
 };
 
 int main(){
-    int node_num, source_node, end_node;
-    cin >> node_num >> source_node >> end_node;
+    int node_num = 0, source_node = 0, end_node = 0;
+    Input input;
+    input.nextInt(node_num);
+    input.nextInt(source_node);
+    input.nextInt(end_node);
     Graph g(node_num);
-    g.readGraph();
+    g.readGraph(input);
     g.shortest_path(source_node, end_node);
     g.DAG();
     g.MST();